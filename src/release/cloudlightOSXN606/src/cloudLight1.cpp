@@ -13,44 +13,2006 @@ static const char* const HELP = "Generates a 3D cloudLight1";
 #include "DDImage/SourceGeo.h"
 #include "DDImage/Scene.h"
 #include "DDImage/Triangle.h"
+#include "DDImage/Point.h"
+#include "DDImage/PolyMesh.h"
 #include "DDImage/Knobs.h"
 #include "DDImage/Knob.h"
 #include "DDImage/Channel3D.h"
+#include "DDImage/CameraOp.h"
+#include "DDImage/Thread.h"
+#include "DDImage/ddImageVersionNumbers.h"
 #include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <new>
 #include <vector>
 
 #include "cloudlet.h"
+#include "cloudletKernels.h"
+#include "cloudletCache.h"
+#include "cloudletGrid.h"
+#include "cloudletOctree.h"
+#include "cloudletPyramid.h"
+
+// Deep images arrived with the Nuke 7 NDK:
+#if kDDImageVersionMajorNum >= 7
+#define CLOUDLIGHT_DEEP 1
+#include "DDImage/DeepOp.h"
+#endif
 
 using namespace DD::Image;
 
+// How cube points are shared between faces:
+enum { TOPOLOGY_UNIQUE = 0, TOPOLOGY_SHARED };
+static const char* const topology_types[] = {
+    "unique vertices", "shared vertices", 0
+};
+
+// How cube triangles are allocated:
+enum { PRIMITIVES_TRIANGLES = 0, PRIMITIVES_MESH };
+static const char* const primitive_types[] = {
+    "triangles", "single mesh", 0
+};
+
+// What each cloudlet becomes:
+enum { OUTPUT_CUBES = 0, OUTPUT_INSTANCES, OUTPUT_BILLBOARDS };
+static const char* const output_types[] = {
+    "cubes", "instances", "billboards", 0
+};
+
+// Solid that cube output turns each cloudlet into:
+enum { SHAPE_CUBE = 0, SHAPE_TETRAHEDRON, SHAPE_OCTAHEDRON };
+static const char* const shape_types[] = {
+    "cube", "tetrahedron", "octahedron", 0
+};
+
+// How the sample grid is turned into cloudlets:
+enum { SAMPLING_UNIFORM = 0, SAMPLING_ADAPTIVE, SAMPLING_VOXEL };
+static const char* const sampling_types[] = {
+    "uniform", "adaptive", "voxel", 0
+};
+
+// What decides which cloudlets a capped cloud keeps:
+enum { IMPORTANCE_ALPHA = 0, IMPORTANCE_LUMINANCE, IMPORTANCE_RED, IMPORTANCE_GREEN, IMPORTANCE_BLUE };
+static const char* const importance_types[] = {
+    "alpha", "luminance", "red", "green", "blue", 0
+};
+
+// Order of the emitted cloudlets:
+enum { ORDER_PIXELS = 0, ORDER_MORTON };
+static const char* const order_types[] = {
+    "pixels", "morton", 0
+};
+
+// Render time shape of an instance:
+static const char* const instance_types[] = {
+    "disc", "square", "particle", 0
+};
+static const Point::RenderMode instance_modes[] = {
+    Point::DISC, Point::SQUARE, Point::PARTICLE
+};
+
 class cloudLight1 : public SourceGeo
 {
 private:
     
-    double resolution;
-    double radius;
-    bool useLuma;
-    double depth;
+    double resolution;
+    double radius;
+    bool useLuma;
+    double depth;
+    int sampling;
+    int budget;
+    int maxCloudlets;
+    int importance;
+    double voxelSize;
+    Channel deepPosition[3];
+    
+    unsigned columns, rows,grid_stream;
+    int gridColumns, gridRows;
+    std::vector<int> sourceColumns;
+    bool useTop, useBottom, useLeft, useRight, useFront , useBack;
+    int topology;
+    int primitiveMode;
+    int output;
+    int instanceShape;
+    int solidShape;
+    const char* cacheDir;
+    bool cull;
+    double cullMargin;
+    bool lod;
+    double lodPixels;
+    bool hideFaces;
+    double faceTolerance;
+    int order;
+    int chunkSize;
+    bool compact;
+    bool accumulate;
+    int firstFrame, lastFrame;
+    
+    // local matrix that Axis_Knob fills in
+    Matrix4 _local;
+    bool fix;
+    Knob* _pAxisKnob;
+    
+    // Cloud extracted from the inputs, sorted by pixel index, and the key
+    // of the inputs it was extracted from:
+    CloudletBuffer clouds;
+    unsigned long long cloudsKey;
+    unsigned long long cloudsExtraction;
+    bool cloudsValid;
+    bool sourceFailed;      // the last extraction could not read a source
+    unsigned droppedBuilds; // builds that ran out of memory, hashed so the next cook retries
+    CloudletOctree octree;
+    bool octreeValid;
+    
+    // Size of each cloudlet of clouds in grid cells, or empty when they
+    // are all 1.
+    CloudletArray<float> cloudSizes;
+    
+    // Faces of each cloudlet of clouds not covered by a cloudlet of the
+    // same or a neighbouring grid pixel, filled in while hiding_faces() is
+    // on.
+    CloudletArray<unsigned char> cloudFaces;
+    
+    // Cloudlets that survive the stages run between extraction and
+    // geometry generation. Unused while staging is off. stagedSizes holds
+    // the size of each staged cloudlet in cloudlets, or is empty when they
+    // are all 1.
+    CloudletBuffer staged;
+    CloudletArray<float> stagedSizes;
+    CloudletArray<unsigned char> stagedFaces;
+    bool staging;
+    
+    // First emitted cloudlet of every output object, and the end. Each
+    // object holds the cloudlets of one tile of the sample grid, and the
+    // hashes of what its points and attributes were last built from.
+    std::vector<size_t> chunkStarts;
+    std::vector<Hash> chunkPointHashes;
+    std::vector<Hash> chunkAttributeHashes;
+    
+    // When chunking runs without staging, the indices of the cloudlets of
+    // clouds grouped by tile, which chunkStarts then points into, and the
+    // one tile gathered from them at a time. chunkOrder is empty otherwise.
+    std::vector<unsigned> chunkOrder;
+    CloudletBuffer chunkCloud;
+    CloudletArray<float> chunkSizes;
+    CloudletArray<unsigned char> chunkFaces;
+    
+    // Which grid samples of the colorMap are solid, and the colorMap hash
+    // and resolution it was found for.
+    Hash coverage;
+    Hash coverageKey;
+    
+    // Rows of the sample grid handed out to worker threads in bands. There
+    // are more bands than threads so that uneven coverage still balances.
+    struct BandJob {
+        cloudLight1* op;
+        Iop* colorMap;
+        Iop* pointMap;
+#ifdef CLOUDLIGHT_DEEP
+        DeepOp* deep;       // replaces both maps when not NULL
+#endif
+        int numRows;        // grid rows split into the bands
+        unsigned numBands;
+        unsigned nextBand;
+        Lock lock;
+        
+        void (*work)(unsigned, unsigned, void*);
+        bool outOfMemory;       // a band could not allocate its cloudlets
+        bool failed;            // a band could not read its source
+        
+        // Stops all bands after the source of one could not be read.
+        void fail()
+        {
+            Guard guard(lock);
+            failed = true;
+            nextBand = numBands;
+        }
+        
+        // Claims the next band and its grid rows [y0, y1).
+        bool next(unsigned& band, int& y0, int& y1)
+        {
+            {
+                Guard guard(lock);
+                band = nextBand++;
+            }
+            if (band >= numBands)
+                return false;
+            
+            y0 = (int)(((long long)numRows * band) / numBands);
+            y1 = (int)(((long long)numRows * (band + 1)) / numBands);
+            return true;
+        }
+    };
+    
+    // Each band fills its own buffer and the buffers are merged in band
+    // order, so the result matches a serial scan.
+    struct ExtractJob : BandJob {
+        std::vector<CloudletBuffer> bands;
+    };
+    
+    // Adaptive sampling stores every band straight into the pyramid.
+    struct SampleJob : BandJob {
+        CloudletPyramid* pyramid;
+    };
+    
+    // A capped extraction merges every grid row into one shared heap.
+    struct CapJob : BandJob {
+        CloudletHeap heap;
+        Lock heapLock;
+    };
+    
+    // In-place update of the colors and/or positions of the current cloud.
+    struct RefreshJob : BandJob {
+        bool points;
+        bool colors;
+        bool changed;
+    };
+    
+    // Hash of the solid pixel indices of every row of a sample grid of the
+    // colorMap, which is not the grid of the current cloud.
+    struct CoverageJob : BandJob {
+        int columns, rows;
+        int gridColumns;
+        float scale;
+        std::vector<Hash> rowHashes;
+    };
+    
+protected:
+    void _validate(bool for_real)
+    {
+        // The sample grid needs at least one row and column; zero, negative
+        // and NaN resolutions would size it to nothing or less:
+        if (!(resolution >= 0.001))
+            resolution = 0.001;
+        if (CameraOp* cam = camera())
+            cam->validate(for_real);
+        SourceGeo::_validate(for_real);
+        
+    }
+    
+    // Validates both maps and requests their whole area.
+    void request_maps(Iop* colorMap, Iop* pointMap)
+    {
+        colorMap->validate(true);
+        colorMap->request(0, 0,  colorMap->w(),  colorMap->h(), Mask_RGBA, 0);
+        
+        pointMap->validate(true);
+        pointMap->request(0, 0,  pointMap->w(),  pointMap->h(), Mask_RGBA, 0);
+    }
+    
+    // Cloudlet position of grid sample (x, y), read from source column sx
+    // of a fetched pointMap row.
+    void sample_point(const Row& pointRow, int x, int y, int sx, float& px, float& py, float& pz) const
+    {
+        px = pointRow[Chan_Red][sx];
+        py = pointRow[Chan_Green][sx];
+        pz = pointRow[Chan_Blue][sx];
+        
+        if (useLuma) {
+            float lum = (px + py + pz) / 3.0f;
+            
+            px = x;
+            py = y;
+            pz = lum * ((columns + rows) / 10.0f);
+        }
+    }
+    
+    /*! Fetches whole scanlines of both maps for the grid rows [y0, y1) and
+        pushes a cloudlet for every solid sample into dest, in row-major
+        order. The pointMap row is only fetched when the colorMap row has
+        coverage.
+     */
+    template <class Sink>
+    void extract_rows(Iop* colorMap, Iop* pointMap, int y0, int y1, Sink& dest)
+    {
+        float scale = 1.0 / resolution;
+        
+        Row colorRow(0, columns);
+        Row pointRow(0, columns);
+        
+        for (int y = y0; y < y1; y++) {
+            if (aborted())
+                return;
+            
+            int sy = MIN((int)(y * scale), (int)rows - 1);
+            colorMap->get(sy, 0, columns, Mask_RGBA, colorRow);
+            
+            const float* red   = colorRow[Chan_Red];
+            const float* green = colorRow[Chan_Green];
+            const float* blue  = colorRow[Chan_Blue];
+            const float* alpha = colorRow[Chan_Alpha];
+            
+            bool pointsFetched = false;
+            
+            for (int x = 0; x < gridColumns; x++) {
+                int sx = sourceColumns[x];
+                
+                //only create if its solid
+                if (alpha[sx] <= 0.5f)
+                    continue;
+                
+                if (!pointsFetched) {
+                    pointMap->get(sy, 0, columns, Mask_RGB, pointRow);
+                    pointsFetched = true;
+                }
+                
+                cloudlet CL;
+                
+                CL.r = red[sx];
+                CL.g = green[sx];
+                CL.b = blue[sx];
+                
+                sample_point(pointRow, x, y, sx, CL.x, CL.y, CL.z);
+                
+                CL.p = (y * gridColumns) + x;
+                store(dest, CL, alpha[sx]);
+            }
+        }
+    }
+    
+#ifdef CLOUDLIGHT_DEEP
+    /*! Fetches one deep scanline at a time for the grid rows [y0, y1) and
+        pushes a cloudlet for every solid sample of every grid pixel into
+        dest, in row-major order and front to back within a pixel. Only a
+        scanline of deep data is held at once; the samples themselves go
+        straight into the sink. Returns false when a scanline could not be
+        read.
+     */
+    template <class Sink>
+    bool extract_deep_rows(DeepOp* deep, int y0, int y1, Sink& dest)
+    {
+        float scale = 1.0 / resolution;
+        ChannelSet channels = deep_channels();
+        bool gridPositions = grid_positions();
+        
+        for (int y = y0; y < y1; y++) {
+            if (aborted())
+                return true;
+            
+            int sy = MIN((int)(y * scale), (int)rows - 1);
+            DeepPlane plane;
+            if (!deep->deepEngine(Box(0, sy, columns, sy + 1), channels, plane))
+                return false;
+            
+            for (int x = 0; x < gridColumns; x++) {
+                DeepPixel pixel = plane.getPixel(sy, sourceColumns[x]);
+                unsigned samples = pixel.getSampleCount();
+                
+                for (unsigned i = 0; i < samples; i++) {
+                    float alpha = pixel.getOrderedSample(i, Chan_Alpha);
+                    if (alpha <= 0.5f)
+                        continue;
+                    
+                    cloudlet CL;
+                    
+                    CL.r = pixel.getOrderedSample(i, Chan_Red);
+                    CL.g = pixel.getOrderedSample(i, Chan_Green);
+                    CL.b = pixel.getOrderedSample(i, Chan_Blue);
+                    
+                    if (gridPositions) {
+                        CL.x = x;
+                        CL.y = y;
+                        CL.z = pixel.getOrderedSample(i, Chan_DeepFront);
+                    }
+                    else {
+                        CL.x = pixel.getOrderedSample(i, deepPosition[0]);
+                        CL.y = pixel.getOrderedSample(i, deepPosition[1]);
+                        CL.z = pixel.getOrderedSample(i, deepPosition[2]);
+                    }
+                    
+                    CL.p = (y * gridColumns) + x;
+                    store(dest, CL, alpha);
+                }
+            }
+        }
+        return true;
+    }
+    
+    ChannelSet deep_channels() const
+    {
+        ChannelSet channels(Mask_RGBA);
+        channels += Chan_DeepFront;
+        for (int a = 0; a < 3; a++)
+            channels += deepPosition[a];
+        return channels;
+    }
+#endif
+    
+    // Rows [y0, y1) of the source of job into dest.
+    template <class Sink>
+    void extract_job_rows(BandJob& job, int y0, int y1, Sink& dest)
+    {
+#ifdef CLOUDLIGHT_DEEP
+        if (job.deep) {
+            if (!extract_deep_rows(job.deep, y0, y1, dest))
+                job.fail();
+            return;
+        }
+#endif
+        extract_rows(job.colorMap, job.pointMap, y0, y1, dest);
+    }
+    
+    /*! Rewrites the colors and/or positions of the cloudlets in grid rows
+        [y0, y1) without changing which pixels are in the cloud. Relies on
+        clouds being sorted by pixel index. Returns false as soon as the
+        colorMap alpha accepts a different set of pixels than the cloud has.
+     */
+    bool refresh_rows(Iop* colorMap, Iop* pointMap, bool points, bool colors, int y0, int y1)
+    {
+        float scale = 1.0 / resolution;
+        
+        Row colorRow(0, columns);
+        Row pointRow(0, columns);
+        
+        const int* P = clouds.p.data();
+        size_t n = clouds.size();
+        size_t cube = std::lower_bound(P, P + n, y0 * gridColumns) - P;
+        
+        for (int y = y0; y < y1; y++) {
+            if (aborted())
+                return true;
+            
+            int sy = MIN((int)(y * scale), (int)rows - 1);
+            int rowStart = y * gridColumns;
+            
+            size_t rowEnd = cube;
+            while (rowEnd < n && P[rowEnd] < rowStart + gridColumns)
+                rowEnd++;
+            
+            if (colors) {
+                colorMap->get(sy, 0, columns, Mask_RGBA, colorRow);
+                
+                const float* red   = colorRow[Chan_Red];
+                const float* green = colorRow[Chan_Green];
+                const float* blue  = colorRow[Chan_Blue];
+                const float* alpha = colorRow[Chan_Alpha];
+                
+                size_t c = cube;
+                for (int x = 0; x < gridColumns; x++) {
+                    int sx = sourceColumns[x];
+                    
+                    bool solid = alpha[sx] > 0.5f;
+                    bool inCloud = c < rowEnd && P[c] == rowStart + x;
+                    if (solid != inCloud)
+                        return false;
+                    
+                    if (solid) {
+                        clouds.r[c] = red[sx];
+                        clouds.g[c] = green[sx];
+                        clouds.b[c] = blue[sx];
+                        c++;
+                    }
+                }
+            }
+            
+            if (points && rowEnd > cube) {
+                pointMap->get(sy, 0, columns, Mask_RGB, pointRow);
+                
+                for (size_t c = cube; c < rowEnd; c++) {
+                    int x = P[c] - rowStart;
+                    sample_point(pointRow, x, y, sourceColumns[x], clouds.x[c], clouds.y[c], clouds.z[c]);
+                }
+            }
+            
+            cube = rowEnd;
+        }
+        return true;
+    }
+    
+    static void extract_band(unsigned index, unsigned nThreads, void* d)
+    {
+        ExtractJob* job = (ExtractJob*)d;
+        unsigned band;
+        int y0, y1;
+        
+        while (job->next(band, y0, y1))
+            job->op->extract_job_rows(*job, y0, y1, job->bands[band]);
+    }
+    
+    // Sinks of extract_rows:
+    static void store(CloudletBuffer& dest, const cloudlet& CL, float alpha) { dest.push_back(CL); }
+    static void store(CloudletPyramid& dest, const cloudlet& CL, float alpha) { dest.push_back(CL); }
+    void store(CloudletHeap& dest, const cloudlet& CL, float alpha) const
+    {
+        dest.push(CL, importance_of(CL, alpha));
+    }
+    
+    float importance_of(const cloudlet& CL, float alpha) const
+    {
+        switch (importance) {
+            default: return alpha;
+            case IMPORTANCE_LUMINANCE: return 0.2126f * CL.r + 0.7152f * CL.g + 0.0722f * CL.b;
+            case IMPORTANCE_RED: return CL.r;
+            case IMPORTANCE_GREEN: return CL.g;
+            case IMPORTANCE_BLUE: return CL.b;
+        }
+    }
+    
+    static void cap_band(unsigned index, unsigned nThreads, void* d)
+    {
+        CapJob* job = (CapJob*)d;
+        unsigned band;
+        int y0, y1;
+        
+        CloudletHeap row(job->op->maxCloudlets);
+        
+        while (job->next(band, y0, y1)) {
+            for (int y = y0; y < y1; y++) {
+                row.clear();
+                job->op->extract_job_rows(*job, y, y + 1, row);
+                
+                Guard guard(job->heapLock);
+                job->heap.merge(row);
+            }
+        }
+    }
+    
+    static void sample_band(unsigned index, unsigned nThreads, void* d)
+    {
+        SampleJob* job = (SampleJob*)d;
+        unsigned band;
+        int y0, y1;
+        
+        while (job->next(band, y0, y1))
+            job->op->extract_job_rows(*job, y0, y1, *job->pyramid);
+    }
+    
+    static void refresh_band(unsigned index, unsigned nThreads, void* d)
+    {
+        RefreshJob* job = (RefreshJob*)d;
+        unsigned band;
+        int y0, y1;
+        
+        while (job->next(band, y0, y1)) {
+            if (!job->op->refresh_rows(job->colorMap, job->pointMap, job->points, job->colors, y0, y1)) {
+                Guard guard(job->lock);
+                job->changed = true;
+                job->nextBand = job->numBands;
+            }
+        }
+    }
+    
+    static void coverage_band(unsigned index, unsigned nThreads, void* d)
+    {
+        CoverageJob* job = (CoverageJob*)d;
+        unsigned band;
+        int y0, y1;
+        
+        while (job->next(band, y0, y1))
+            job->op->coverage_rows(*job, y0, y1);
+    }
+    
+    // Number of bands the sample grid rows are split into.
+    unsigned band_count() const
+    {
+        return band_count(gridRows);
+    }
+    
+    unsigned band_count(int numRows) const
+    {
+        unsigned numThreads = MAX(Thread::numThreads, 1u);
+        return MIN(numThreads * 4, (unsigned)MAX(numRows, 1));
+    }
+    
+    // Points job at frame m of the inputs the cloud is extracted from.
+    void source_job(BandJob& job, int m)
+    {
+        job.colorMap = color_map(m);
+        job.pointMap = point_map(m);
+#ifdef CLOUDLIGHT_DEEP
+        job.deep = deep_map(m);
+#endif
+    }
+    
+    // Runs the work of one thread, stopping all bands when it runs out of
+    // memory, since an exception must not leave a worker thread.
+    static void band_thread(unsigned index, unsigned nThreads, void* d)
+    {
+        BandJob* job = (BandJob*)d;
+        try {
+            job->work(index, nThreads, d);
+        }
+        catch (const std::bad_alloc&) {
+            Guard guard(job->lock);
+            job->outOfMemory = true;
+            job->nextBand = job->numBands;
+        }
+    }
+    
+    /*! Runs work over all bands of job on all threads. Throws
+        std::bad_alloc on the calling thread when any band ran out of
+        memory, and reports an error when any band could not read its
+        source, which leaves the cloud cut short like an abort.
+     */
+    void run_bands(BandJob& job, void (*work)(unsigned, unsigned, void*))
+    {
+        run_bands(job, work, gridRows);
+    }
+    
+    // Same over the first numRows rows of some other grid.
+    void run_bands(BandJob& job, void (*work)(unsigned, unsigned, void*), int numRows)
+    {
+        unsigned numThreads = MAX(Thread::numThreads, 1u);
+        
+        job.op = this;
+        job.numRows = numRows;
+        job.numBands = band_count(numRows);
+        job.nextBand = 0;
+        job.work = work;
+        job.outOfMemory = false;
+        job.failed = false;
+        
+        if (numThreads > 1 && job.numBands > 1) {
+            Thread::spawn(band_thread, MIN(numThreads, job.numBands), &job);
+            Thread::wait(&job);
+        }
+        else {
+            band_thread(0, 1, &job);
+        }
+        
+        if (job.outOfMemory)
+            throw std::bad_alloc();
+        
+        if (job.failed) {
+            sourceFailed = true;
+            error("Could not read the deep input; the cloud is incomplete.");
+        }
+    }
+    
+    /*! Fills dest from the whole grid of frame m using all threads. Band
+        offsets are a prefix sum of the band sizes, so the merged order is
+        identical to a single extract_rows() call over every row.
+     */
+    void extract_frame(int m, CloudletBuffer& dest)
+    {
+        ExtractJob job;
+        source_job(job, m);
+        job.bands.resize(band_count());
+        
+        run_bands(job, extract_band);
+        
+        unsigned numBands = job.numBands;
+        std::vector<size_t> offsets(numBands + 1, 0);
+        for (unsigned band = 0; band < numBands; band++)
+            offsets[band + 1] = offsets[band] + job.bands[band].size();
+        
+        dest.resize(offsets[numBands]);
+        for (unsigned band = 0; band < numBands; band++)
+            dest.copy_from(offsets[band], job.bands[band]);
+    }
+    
+    void extract_clouds()
+    {
+        extract_frame(0, clouds);
+        cloudSizes.clear();
+    }
+    
+    /*! Fills clouds with the maxCloudlets most important solid samples.
+        Threads extract one grid row at a time into a heap of their own and
+        merge it into a single shared heap, so memory stays proportional to
+        the cap plus a row per thread rather than to the grid.
+     */
+    void extract_capped()
+    {
+        CapJob job;
+        source_job(job, 0);
+        job.heap = CloudletHeap(maxCloudlets);
+        
+        run_bands(job, cap_band);
+        
+        job.heap.extract(clouds);
+        cloudSizes.clear();
+    }
+    
+    /*! Fills clouds with at most budget cloudlets that sample the grid
+        densely where the colors or positions vary and sparsely where they
+        are flat. Each cloudlet is the average of a quadtree block of grid
+        samples and is as large as its block.
+     */
+    void extract_adaptive()
+    {
+        CloudletPyramid pyramid;
+        pyramid.resize(gridColumns, gridRows);
+        
+        SampleJob job;
+        source_job(job, 0);
+        job.pyramid = &pyramid;
+        
+        run_bands(job, sample_band);
+        
+        pyramid.build();
+        pyramid.select((size_t)MAX(budget, 1), clouds, cloudSizes);
+    }
+    
+    /*! Fills clouds with one cloudlet per voxel of the solid samples of
+        every frame the cloud is made of. Frames are extracted and folded
+        into the voxel grid one at a time, so only a single frame of
+        cloudlets is held at once. Frames whose format differs from the
+        first frame are skipped. The maxCloudlets most important voxels
+        are kept.
+     */
+    void extract_voxels()
+    {
+        if (!(voxel_size() > 0.0f)) {
+            error("Voxel size must be positive; set voxelSize or a positive radius.");
+            clouds.clear();
+            cloudSizes.clear();
+            return;
+        }
+        
+        float scale[3];
+        point_scale(scale);
+        CloudletVoxelGrid grid(voxel_size(), scale);
+        CloudletBuffer frame;
+        
+        for (int m = 0; m < frame_count() && !cut_short(); m++) {
+            unsigned w, h;
+            request_source(m, w, h);
+            SourceGuard guard(this, m);
+            
+            if (w == columns && h == rows) {
+                extract_frame(m, frame);
+                grid.add(frame);
+            }
+        }
+        
+        grid.extract(clouds);
+        cloudSizes.clear();
+        
+        // Voxels average solid samples, so they all rank as opaque:
+        if (maxCloudlets > 0) {
+            CloudletHeap kept(maxCloudlets);
+            for (size_t i = 0; i < clouds.size(); i++)
+                store(kept, clouds.get(i), 1.0f);
+            kept.extract(clouds);
+        }
+    }
+    
+    /*! Updates the cloud in place from the current inputs: positions from
+        the pointMap and/or colors from the colorMap. Returns false when the
+        cloud topology has to be rebuilt instead, i.e. when the colorMap
+        format or its alpha coverage changed, the cloud is incomplete,
+        adaptively sampled, binned into voxels or extracted from deep
+        samples.
+     */
+    bool refresh_clouds(bool points, bool colors)
+    {
+        // Adaptive blocks, voxels and deep samples follow the input contents:
+        if (!cloudsValid || sampling_mode() != SAMPLING_UNIFORM || use_deep())
+            return false;
+        
+        unsigned w, h;
+        request_source(0, w, h);
+        SourceGuard guard(this, 0);
+        
+        if (w != columns || h != rows)
+            return false;
+        
+        // A cached cloud replaces the refresh if it covers the same pixels:
+        CloudletBuffer cached;
+        if (load_cache(cached)) {
+            if (cached.size() != clouds.size() ||
+                memcmp(cached.p.data(), clouds.p.data(), clouds.size() * sizeof(int)) != 0)
+                return false;
+            clouds.swap(cached);
+            octreeValid = false;
+            remember_clouds();
+            return true;
+        }
+        
+        RefreshJob job;
+        source_job(job, 0);
+        job.points = points;
+        job.colors = colors;
+        job.changed = false;
+        
+        run_bands(job, refresh_band);
+        
+        if (job.changed) {
+            cloudsValid = false;
+            return false;
+        }
+        
+        // Refreshed clouds are not cached, or scrubbing would write a file
+        // per frame; only full extractions are.
+        if (points)
+            octreeValid = false;
+        remember_clouds();
+        return true;
+    }
+    
+    // Cache files hold uniformly sampled or voxel clouds only.
+    bool use_cache() const
+    {
+        return cacheDir != NULL && cacheDir[0] != 0 && sampling_mode() != SAMPLING_ADAPTIVE;
+    }
+    
+    // Disk cache key of the cloud extracted from the current inputs.
+    unsigned long long cache_key() const
+    {
+        Hash key;
+        for (int m = 0; m < frame_count(); m++) {
+            if (use_deep()) {
+                key.append(deep_input(m)->hash());
+                continue;
+            }
+            key.append(color_map(m)->hash());
+            key.append(point_map(m)->hash());
+        }
+        key.append(extraction_key());
+        return key.value();
+    }
+    
+    // Key of the knobs the cloud is extracted with, whatever the inputs.
+    unsigned long long extraction_key() const
+    {
+        Hash key;
+        if (use_deep()) {
+            for (int a = 0; a < 3; a++)
+                key.append(deepPosition[a]);
+        }
+        if (accumulate) {
+            key.append(firstFrame);
+            key.append(lastFrame);
+        }
+        if (voxelized())
+            key.append(voxel_size());
+        key.append(resolution);
+        key.append(useLuma);
+        key.append(depth);
+        key.append(sampling);
+        key.append(budget);
+        key.append(maxCloudlets);
+        key.append(importance);
+        return key.value();
+    }
+    
+    bool load_cache(CloudletBuffer& dest) const
+    {
+        if (!use_cache())
+            return false;
+        return cloudlet_cache_load(cacheDir, cache_key(), gridColumns, gridRows, dest);
+    }
+    
+    void save_cache()
+    {
+        if (use_cache() && !cut_short())
+            cloudlet_cache_save(cacheDir, cache_key(), gridColumns, gridRows, clouds);
+    }
+    
+    // Whether the cloud being extracted is incomplete, because the op was
+    // aborted or a source could not be read.
+    bool cut_short() const
+    {
+        return aborted() || sourceFailed;
+    }
+    
+    // Records which inputs clouds now holds, unless it was cut short.
+    void remember_clouds()
+    {
+        cloudsValid = !cut_short();
+        cloudsKey = cache_key();
+        cloudsExtraction = extraction_key();
+    }
+    
+    bool clouds_match() const
+    {
+        return cloudsValid && cloudsKey == cache_key();
+    }
+    
+    // Whether the cloud was extracted with the current knobs, so new inputs
+    // of the same coverage only need a refresh. Capped clouds keep the
+    // samples the old colors ranked highest and are extracted again.
+    bool clouds_refreshable() const
+    {
+        return cloudsValid && cloudsExtraction == extraction_key() && maxCloudlets <= 0;
+    }
+    
+    // Frames of the maps the cloud is made of. Every frame is a separate
+    // copy of the map inputs, see split_input().
+    int frame_count() const
+    {
+        return accumulate ? MAX(lastFrame - firstFrame, 0) + 1 : 1;
+    }
+    
+    // Maps of frame m of the accumulation range, or of the current frame.
+    Iop* color_map(int m = 0) const
+    {
+        return (Iop*)input(0, m);
+    }
+    
+    Iop* point_map(int m = 0) const
+    {
+        return (Iop*)input(1, m);
+    }
+    
+    // The deep input of frame m, or NULL when the cloud comes from the
+    // maps.
+    Op* deep_input(int m = 0) const
+    {
+        return node_inputs() > 3 ? input(3, m) : NULL;
+    }
+    
+    bool use_deep() const
+    {
+        return deep_input() != NULL;
+    }
+    
+#ifdef CLOUDLIGHT_DEEP
+    DeepOp* deep_map(int m = 0) const
+    {
+        return dynamic_cast<DeepOp*>(deep_input(m));
+    }
+#endif
+    
+    // Validates frame m of the inputs the cloud is extracted from, the deep
+    // input when one is connected or else both maps, requests their whole
+    // area and returns its size.
+    void request_source(int m, unsigned& w, unsigned& h)
+    {
+#ifdef CLOUDLIGHT_DEEP
+        if (DeepOp* deep = deep_map(m)) {
+            deep->op()->validate(true);
+            const Format* format = deep->deepInfo().format();
+            w = format->width();
+            h = format->height();
+            deep->deepRequest(Box(0, 0, w, h), deep_channels());
+            return;
+        }
+#endif
+        Iop* colorMap = color_map(m);
+        Iop* pointMap = point_map(m);
+        request_maps(colorMap, pointMap);
+        w = colorMap->w();
+        h = colorMap->h();
+    }
+    
+    void close_source(int m)
+    {
+        if (use_deep())
+            return;
+        color_map(m)->close();
+        point_map(m)->close();
+    }
+    
+    // Closes frame m of the source when it goes out of scope, on early
+    // returns and exceptions alike.
+    struct SourceGuard {
+        cloudLight1* op;
+        int m;
+        
+        SourceGuard(cloudLight1* o, int frame) : op(o), m(frame) {}
+        ~SourceGuard() { op->close_source(m); }
+    };
+    
+    // Sampling in effect. Accumulated frames are always merged in the voxel
+    // grid, and deep pixels have no single sample to build adaptive blocks
+    // from.
+    int sampling_mode() const
+    {
+        if (accumulate)
+            return SAMPLING_VOXEL;
+        if (sampling == SAMPLING_ADAPTIVE && use_deep())
+            return SAMPLING_UNIFORM;
+        return sampling;
+    }
+    
+    bool voxelized() const
+    {
+        return sampling_mode() == SAMPLING_VOXEL;
+    }
+    
+    // Whether cloudlets sit at their grid sample with a depth in z, rather
+    // than at a position read from the inputs.
+    bool grid_positions() const
+    {
+        if (use_deep())
+            return deepPosition[0] == Chan_Black;
+        return useLuma;
+    }
+    
+    // World space edge of the voxels; 0 means one cloudlet cube.
+    float voxel_size() const
+    {
+        return voxelSize > 0.0 ? (float)voxelSize : (float)(radius / resolution);
+    }
+    
+    CameraOp* camera() const
+    {
+        return node_inputs() > 2 ? dynamic_cast<CameraOp*>(input(2, 0)) : NULL;
+    }
+    
+    // The camera clouds are culled against, or NULL when not culling.
+    CameraOp* culling_camera() const
+    {
+        return cull ? camera() : NULL;
+    }
+    
+    // The camera level of detail is computed for, or NULL.
+    CameraOp* lod_camera() const
+    {
+        return lod ? camera() : NULL;
+    }
+    
+    // Per axis multiplier from cloudlet position to object space.
+    void point_scale(float scale[3]) const
+    {
+        scale[0] = scale[1] = scale[2] = 1.0f;
+        if (grid_positions()) {
+            scale[0] = scale[1] = 1.0/resolution;
+            scale[2] = depth;
+        }
+    }
+    
+    /*! Object space unit vectors along the x and y axes of the camera,
+        which billboards are spanned by, or the object x and y axes when
+        there is no camera.
+     */
+    void billboard_axes(float right[3], float up[3]) const
+    {
+        right[0] = 1.0f; right[1] = 0.0f; right[2] = 0.0f;
+        up[0] = 0.0f; up[1] = 1.0f; up[2] = 0.0f;
+        
+        CameraOp* cam = camera();
+        if (!cam)
+            return;
+        
+        Matrix4 m = cam->imatrix() * _local;
+        Vector3 x(m.a00, m.a01, m.a02);
+        Vector3 y(m.a10, m.a11, m.a12);
+        if (x.normalize() > 0.0f && y.normalize() > 0.0f) {
+            right[0] = x.x; right[1] = x.y; right[2] = x.z;
+            up[0] = y.x; up[1] = y.y; up[2] = y.z;
+        }
+    }
+    
+    // Camera view the stages select and merge cloudlets against.
+    struct StageView {
+        Matrix4 m;          // octree position to clip space
+        float aspect;       // film width over film height
+        float limit;        // frame half width in clip units, margin included
+        bool cull;
+        bool lod;
+        float unitPixels;   // pixels covered by one octree unit at unit depth
+        float target;       // largest footprint of a merged cube in pixels
+        float size;         // edge of one cloudlet cube
+    };
+    
+    // One staged cloudlet: the average of octree entries [begin, end),
+    // whose smallest cloudlet index is first.
+    struct StageItem {
+        unsigned first, begin, end;
+        float size;
+        
+        bool operator<(const StageItem& other) const { return first < other.first; }
+    };
+    
+    enum { VIEW_OUTSIDE, VIEW_PARTIAL, VIEW_INSIDE };
+    
+    static bool view_contains(const StageView& view, float x, float y, float z)
+    {
+        const Matrix4& m = view.m;
+        
+        // Behind the camera:
+        float w = m.a30 * x + m.a31 * y + m.a32 * z + m.a33;
+        if (w <= 0.0f)
+            return false;
+        
+        float cx = m.a00 * x + m.a01 * y + m.a02 * z + m.a03;
+        float cy = (m.a10 * x + m.a11 * y + m.a12 * z + m.a13) * view.aspect;
+        return fabsf(cx) <= view.limit * w && fabsf(cy) <= view.limit * w;
+    }
+    
+    /*! Classifies the bounds of node against the frame, which is convex, by
+        their corners. Also returns the smallest clip w of the corners.
+     */
+    static int view_classify(const StageView& view, const CloudletOctreeNode& node, float& minW)
+    {
+        const Matrix4& m = view.m;
+        
+        // Corners outside each of the w > 0, +x, -x, +y and -y planes:
+        int outside[5] = { 0, 0, 0, 0, 0 };
+        int inside = 0;
+        minW = 1e30f;
+        
+        for (int corner = 0; corner < 8; corner++) {
+            float x = (corner & 1) ? node.hi[0] : node.lo[0];
+            float y = (corner & 2) ? node.hi[1] : node.lo[1];
+            float z = (corner & 4) ? node.hi[2] : node.lo[2];
+            
+            float w = m.a30 * x + m.a31 * y + m.a32 * z + m.a33;
+            float cx = m.a00 * x + m.a01 * y + m.a02 * z + m.a03;
+            float cy = (m.a10 * x + m.a11 * y + m.a12 * z + m.a13) * view.aspect;
+            float lw = view.limit * w;
+            minW = MIN(minW, w);
+            
+            bool out[5] = { w <= 0.0f, cx > lw, -cx > lw, cy > lw, -cy > lw };
+            bool in = true;
+            for (int plane = 0; plane < 5; plane++) {
+                if (out[plane]) {
+                    outside[plane]++;
+                    in = false;
+                }
+            }
+            if (in)
+                inside++;
+        }
+        
+        if (!view.cull)
+            return VIEW_INSIDE;
+        for (int plane = 0; plane < 5; plane++) {
+            if (outside[plane] == 8)
+                return VIEW_OUTSIDE;
+        }
+        return inside == 8 ? VIEW_INSIDE : VIEW_PARTIAL;
+    }
+    
+    /*! Adds the staged cloudlets of an octree node to items. Nodes outside
+        the frame are skipped whole, nodes inside it are not tested any
+        further, and with LOD on a node whose extent projects to at most
+        the target footprint becomes a single merged cloudlet.
+     */
+    void stage_node(const CloudletOctree& tree, const StageView& view, int index, bool inside,
+                    std::vector<StageItem>& items) const
+    {
+        const CloudletOctreeNode& node = tree.nodes[index];
+        
+        float minW;
+        int state = view_classify(view, node, minW);
+        if (!inside) {
+            if (state == VIEW_OUTSIDE)
+                return;
+            inside = state == VIEW_INSIDE;
+        }
+        
+        if (view.lod && inside && node.end - node.begin > 1 && minW > 0.0f) {
+            float extent = MAX(node.hi[0] - node.lo[0], MAX(node.hi[1] - node.lo[1], node.hi[2] - node.lo[2]));
+            if (extent * view.unitPixels <= view.target * minW) {
+                StageItem item;
+                item.first = *std::min_element(tree.order.data() + node.begin, tree.order.data() + node.end);
+                item.begin = node.begin;
+                item.end = node.end;
+                item.size = MAX(extent / view.size, 1.0f);
+                items.push_back(item);
+                return;
+            }
+        }
+        
+        if (node.firstChild < 0) {
+            for (unsigned k = node.begin; k < node.end; k++) {
+                if (!inside && !view_contains(view, tree.x[k], tree.y[k], tree.z[k]))
+                    continue;
+                
+                StageItem item;
+                item.first = tree.order[k];
+                item.begin = k;
+                item.end = k + 1;
+                item.size = cloudSizes.empty() ? 1.0f : cloudSizes[item.first];
+                items.push_back(item);
+            }
+            return;
+        }
+        
+        for (int c = 0; c < node.children; c++)
+            stage_node(tree, view, node.firstChild + c, inside, items);
+    }
+    
+    // Octree over the positions of clouds, built on first use after they
+    // change.
+    const CloudletOctree& cloud_octree()
+    {
+        if (!octreeValid) {
+            float scale[3];
+            point_scale(scale);
+            octree.build(clouds, scale);
+            octreeValid = true;
+        }
+        return octree;
+    }
+    
+    /*! Fills cloudFaces with the faces of every cloudlet of clouds that no
+        cloudlet of the same or a neighbouring grid pixel covers. Two
+        cloudlets cover each other's facing faces when their offset is
+        mostly along one axis and no longer than a cube, and off that axis
+        by at most faceTolerance cubes. Every cloudlet of a
+        deep pixel is compared with every cloudlet of its neighbours.
+     */
+    void find_hidden_faces()
+    {
+        size_t n = clouds.size();
+        cloudFaces.resize(n);
+        for (size_t i = 0; i < n; i++)
+            cloudFaces[i] = CLOUDLET_ALL_FACES;
+        
+        float scale[3];
+        point_scale(scale);
+        float size = radius / resolution;
+        float tolerance = faceTolerance * size;
+        
+        const int* P = clouds.p.data();
+        size_t above = 0;
+        size_t end;
+        
+        for (size_t begin = 0; begin < n; begin = end) {
+            end = begin + 1;
+            while (end < n && P[end] == P[begin])
+                end++;
+            
+            // The cloudlets of the next pixel in the row and in the column:
+            size_t next = end;
+            size_t nextEnd = end;
+            if (next < n && P[next] == P[begin] + 1 && P[next] % gridColumns != 0) {
+                while (nextEnd < n && P[nextEnd] == P[next])
+                    nextEnd++;
+            }
+            
+            while (above < n && P[above] < P[begin] + gridColumns)
+                above++;
+            size_t aboveEnd = above;
+            while (aboveEnd < n && P[aboveEnd] == P[begin] + gridColumns)
+                aboveEnd++;
+            
+            for (size_t i = begin; i < end; i++) {
+                for (size_t j = i + 1; j < end; j++)
+                    hide_touching_faces(i, j, scale, size, tolerance);
+                for (size_t j = next; j < nextEnd; j++)
+                    hide_touching_faces(i, j, scale, size, tolerance);
+                for (size_t j = above; j < aboveEnd; j++)
+                    hide_touching_faces(i, j, scale, size, tolerance);
+            }
+        }
+    }
+    
+    // Clears the facing faces of cloudlets i and j of clouds if they touch.
+    void hide_touching_faces(size_t i, size_t j, const float scale[3], float size, float tolerance)
+    {
+        static const int positive[3] = { CLOUDLET_RIGHT, CLOUDLET_TOP, CLOUDLET_FRONT };
+        static const int negative[3] = { CLOUDLET_LEFT, CLOUDLET_BOTTOM, CLOUDLET_BACK };
+        
+        float d[3] = { (clouds.x[j] - clouds.x[i]) * scale[0],
+                       (clouds.y[j] - clouds.y[i]) * scale[1],
+                       (clouds.z[j] - clouds.z[i]) * scale[2] };
+        
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (fabsf(d[a]) > fabsf(d[axis]))
+                axis = a;
+        }
+        if (fabsf(d[axis]) > size ||
+            fabsf(d[(axis + 1) % 3]) > tolerance || fabsf(d[(axis + 2) % 3]) > tolerance)
+            return;
+        
+        if (d[axis] >= 0.0f) {
+            cloudFaces[i] &= ~positive[axis];
+            cloudFaces[j] &= ~negative[axis];
+        }
+        else {
+            cloudFaces[i] &= ~negative[axis];
+            cloudFaces[j] &= ~positive[axis];
+        }
+    }
+    
+    /*! Runs the stages between extraction and geometry generation on the
+        current clouds through the octree: culling drops the cloudlets
+        outside the camera frame and LOD merges those far enough away into
+        larger cubes with their average position and color. A merged
+        cloudlet takes the pixel index of its first cloudlet and keeps all
+        of its faces. The output is in pixel index order, or in the Morton
+        order of the octree, and grouped by tile when chunking is on.
+        Chunking alone leaves clouds as it is and only groups its indices.
+     */
+    void stage_clouds()
+    {
+        if (hiding_faces())
+            find_hidden_faces();
+        else
+            cloudFaces.clear();
+        
+        staging = culling_camera() || lod_camera() || order == ORDER_MORTON;
+        stagedSizes.clear();
+        stagedFaces.clear();
+        staged.clear();
+        if (!staging) {
+            find_chunks();
+            return;
+        }
+        
+        StageView view;
+        view.m.makeIdentity();
+        view.aspect = view.limit = view.unitPixels = view.target = 1.0f;
+        view.cull = view.lod = false;
+        view.size = radius / resolution;
+        
+        if (CameraOp* cam = camera()) {
+            view.m = cam->projection() * cam->imatrix() * _local;
+            view.aspect = (float)(cam->film_width() / cam->film_height());
+            view.limit = 1.0f + 2.0f * (float)cullMargin;
+            view.cull = cull;
+            view.lod = lod;
+            // The colorMap width stands in for the output width:
+            view.unitPixels = cam->projection().a00 * columns / 2.0f *
+                              Vector3(_local.a00, _local.a10, _local.a20).length();
+            view.target = (float)lodPixels;
+        }
+        
+        // The traversal visits the octree in Morton order:
+        const CloudletOctree& tree = cloud_octree();
+        std::vector<StageItem> items;
+        if (!tree.empty())
+            stage_node(tree, view, 0, false, items);
+        if (order == ORDER_PIXELS)
+            std::sort(items.begin(), items.end());
+        
+        // Tiles one after another, each in the order above:
+        if (chunkSize > 0) {
+            std::vector<std::pair<int, size_t> > tiles(items.size());
+            for (size_t i = 0; i < items.size(); i++)
+                tiles[i] = std::make_pair(chunk_tile(clouds.p[items[i].first]), i);
+            std::sort(tiles.begin(), tiles.end());
+            
+            std::vector<StageItem> sorted(items.size());
+            for (size_t i = 0; i < tiles.size(); i++)
+                sorted[i] = items[tiles[i].second];
+            items.swap(sorted);
+        }
+        
+        bool sized = view.lod || !cloudSizes.empty();
+        staged.reserve(items.size());
+        if (sized)
+            stagedSizes.resize(items.size());
+        if (hiding_faces())
+            stagedFaces.resize(items.size());
+        
+        for (size_t i = 0; i < items.size(); i++) {
+            const StageItem& item = items[i];
+            cloudlet CL = clouds.get(item.first);
+            
+            unsigned count = item.end - item.begin;
+            if (count > 1) {
+                CL.x = CL.y = CL.z = CL.r = CL.g = CL.b = 0.0f;
+                for (unsigned k = item.begin; k < item.end; k++) {
+                    unsigned c = tree.order[k];
+                    CL.x += clouds.x[c];
+                    CL.y += clouds.y[c];
+                    CL.z += clouds.z[c];
+                    CL.r += clouds.r[c];
+                    CL.g += clouds.g[c];
+                    CL.b += clouds.b[c];
+                }
+                float inv = 1.0f / count;
+                CL.x *= inv;
+                CL.y *= inv;
+                CL.z *= inv;
+                CL.r *= inv;
+                CL.g *= inv;
+                CL.b *= inv;
+            }
+            
+            staged.push_back(CL);
+            if (sized)
+                stagedSizes[i] = item.size;
+            if (hiding_faces())
+                stagedFaces[i] = count > 1 ? CLOUDLET_ALL_FACES : cloudFaces[item.first];
+        }
+        
+        find_chunks();
+    }
+    
+    // Tile of the sample grid that pixel index p falls in.
+    int chunk_tile(int p) const
+    {
+        int tiles = (gridColumns + chunkSize - 1) / chunkSize;
+        return (p / gridColumns / chunkSize) * tiles + (p % gridColumns) / chunkSize;
+    }
+    
+    /*! Splits the emitted cloud into runs of cloudlets of the same tile, or
+        keeps it whole when chunking is off. A staged cloud is already
+        grouped by tile. Otherwise a counting pass over the tiles fills
+        chunkOrder with the indices of clouds tile by tile, in pixel order
+        within a tile, so clouds itself is never copied.
+     */
+    void find_chunks()
+    {
+        const CloudletBuffer& cloud = emitted();
+        size_t n = cloud.size();
+        
+        chunkStarts.assign(1, 0);
+        chunkOrder.clear();
+        
+        if (chunkSize > 0 && staging) {
+            for (size_t i = 1; i < n; i++) {
+                if (chunk_tile(cloud.p[i]) != chunk_tile(cloud.p[i - 1]))
+                    chunkStarts.push_back(i);
+            }
+        }
+        else if (chunkSize > 0 && n > 0) {
+            int across = (gridColumns + chunkSize - 1) / chunkSize;
+            int down = (gridRows + chunkSize - 1) / chunkSize;
+            std::vector<size_t> starts((size_t)across * down + 1, 0);
+            for (size_t i = 0; i < n; i++)
+                starts[chunk_tile(cloud.p[i]) + 1]++;
+            for (size_t t = 1; t < starts.size(); t++)
+                starts[t] += starts[t - 1];
+            
+            chunkOrder.resize(n);
+            std::vector<size_t> next(starts.begin(), starts.end() - 1);
+            for (size_t i = 0; i < n; i++)
+                chunkOrder[next[chunk_tile(cloud.p[i])]++] = (unsigned)i;
+            
+            // Empty tiles make no object:
+            for (size_t t = 1; t + 1 < starts.size(); t++) {
+                if (starts[t] > chunkStarts.back())
+                    chunkStarts.push_back(starts[t]);
+            }
+        }
+        chunkStarts.push_back(n);
+    }
+    
+    // The cloud geometry is generated from.
+    const CloudletBuffer& emitted() const
+    {
+        return staging ? staged : clouds;
+    }
+    
+    // Whether the faces between touching cubes are removed. Only the
+    // cubes of uniformly sampled clouds have their grid neighbours at the
+    // next pixel index; adaptive blocks and voxels keep all their faces.
+    bool hiding_faces() const
+    {
+        return hideFaces && output == OUTPUT_CUBES && !cloudlet_solid() &&
+               sampling_mode() == SAMPLING_UNIFORM;
+    }
+    
+    // Face mask of every emitted cube, or NULL when they all have the
+    // faces picked by the knobs.
+    const unsigned char* emitted_faces() const
+    {
+        if (!hiding_faces())
+            return NULL;
+        return staging ? stagedFaces.data() : cloudFaces.data();
+    }
+    
+    // Sizes of the emitted cloudlets, or NULL when they are all 1.
+    const float* emitted_sizes() const
+    {
+        const CloudletArray<float>& sizes = staging ? stagedSizes : cloudSizes;
+        return sizes.empty() ? NULL : sizes.data();
+    }
+    
+    // Adds triangles either as individual primitives or as the faces of a
+    // single PolyMesh, which makes the topology one bulk allocation.
+    struct TriangleSink {
+        GeometryList& out;
+        int obj;
+        PolyMesh* mesh;
+        
+        TriangleSink(GeometryList& o, int object, bool single, unsigned points, unsigned triangles)
+            : out(o), obj(object), mesh(NULL)
+        {
+            if (single)
+                mesh = new PolyMesh(points, triangles);
+        }
+        
+        void add(unsigned a, unsigned b, unsigned c)
+        {
+            if (mesh) {
+                int v[3] = { (int)a, (int)b, (int)c };
+                mesh->add_face(3, v);
+            }
+            else {
+                out.add_primitive(obj, new Triangle(a, b, c));
+            }
+        }
+        
+        void finish()
+        {
+            if (mesh)
+                out.add_primitive(obj, mesh);
+            mesh = NULL;
+        }
+    };
+    
+    // Input of a (possibly threaded) point generation pass.
+    struct PointsJob {
+        const float* x;
+        const float* y;
+        const float* z;
+        size_t count;
+        const float* sizes;
+        CloudletVertexTable table;
+        CloudletVertexKernel kernel;
+        float scale[3];
+        float* out;
+        
+        // With per cube faces: the face mask and first point of each cube,
+        // and a table for every face mask.
+        const unsigned char* faces;
+        const unsigned* offsets;
+        std::vector<CloudletVertexTable> faceTables;
+    };
+    
+    static void emit_points_range(unsigned index, unsigned nThreads, void* d)
+    {
+        PointsJob* job = (PointsJob*)d;
+        
+        size_t begin = (job->count * index) / nThreads;
+        size_t end = (job->count * (index + 1)) / nThreads;
+        if (begin == end)
+            return;
+        
+        if (!job->faces) {
+            job->kernel(job->x, job->y, job->z, job->sizes, begin, end, job->scale,
+                        job->table, job->out + begin * job->table.vertices * 3);
+            return;
+        }
+        
+        // Runs of cubes with the same faces share a table:
+        for (size_t i = begin; i < end; ) {
+            int mask = job->faces[i];
+            size_t j = i + 1;
+            while (j < end && job->faces[j] == mask)
+                j++;
+            
+            job->kernel(job->x, job->y, job->z, job->sizes, i, j, job->scale,
+                        job->faceTables[mask], job->out + job->offsets[i] * 3);
+            i = j;
+        }
+    }
+    
+    // What every cloudlet is turned into, from the face, topology and
+    // output knobs.
+    struct CloudletShape {
+        int faceMask;           // faces of a cube
+        unsigned points;        // points of a cloudlet with all its faces
+        unsigned primitives;    // primitives of such a cloudlet as triangles
+        const CloudletSolid* solid;     // replaces the cube when not NULL
+    };
+    
+    // Solid replacing the cube of cube output, or NULL.
+    const CloudletSolid* cloudlet_solid() const
+    {
+        if (output != OUTPUT_CUBES)
+            return NULL;
+        if (solidShape == SHAPE_TETRAHEDRON)
+            return &cloudletTetrahedron;
+        if (solidShape == SHAPE_OCTAHEDRON)
+            return &cloudletOctahedron;
+        return NULL;
+    }
+    
+    // Emitted cloudlets [begin, end), which make up one output object.
+    struct Chunk {
+        size_t begin, end;
+        const float* x;
+        const float* y;
+        const float* z;
+        const float* r;
+        const float* g;
+        const float* b;
+        const float* S;             // sizes, or NULL when they are all 1
+        const unsigned char* F;     // face masks, or NULL
+        
+        size_t size() const { return end - begin; }
+    };
+    
+    int chunk_count() const
+    {
+        return (int)chunkStarts.size() - 1;
+    }
+    
+    /*! Chunk c of the emitted cloud. A tile listed in chunkOrder is
+        gathered into chunkCloud, so the chunk stays valid until the next
+        call.
+     */
+    Chunk emitted_chunk(int c)
+    {
+        const CloudletBuffer& cloud = emitted();
+        const float* S = emitted_sizes();
+        const unsigned char* F = emitted_faces();
+        
+        Chunk chunk;
+        chunk.begin = chunkStarts[c];
+        chunk.end = chunkStarts[c + 1];
+        
+        if (!chunkOrder.empty()) {
+            size_t n = chunk.size();
+            const unsigned* order = &chunkOrder[chunk.begin];
+            
+            chunkCloud.resize(n);
+            for (size_t k = 0; k < n; k++)
+                chunkCloud.set(k, cloud.get(order[k]));
+            chunkSizes.resize(S ? n : 0);
+            for (size_t k = 0; S && k < n; k++)
+                chunkSizes[k] = S[order[k]];
+            chunkFaces.resize(F ? n : 0);
+            for (size_t k = 0; F && k < n; k++)
+                chunkFaces[k] = F[order[k]];
+            
+            chunk.x = chunkCloud.x.data();
+            chunk.y = chunkCloud.y.data();
+            chunk.z = chunkCloud.z.data();
+            chunk.r = chunkCloud.r.data();
+            chunk.g = chunkCloud.g.data();
+            chunk.b = chunkCloud.b.data();
+            chunk.S = S ? chunkSizes.data() : NULL;
+            chunk.F = F ? chunkFaces.data() : NULL;
+            return chunk;
+        }
+        
+        chunk.x = cloud.x.data() + chunk.begin;
+        chunk.y = cloud.y.data() + chunk.begin;
+        chunk.z = cloud.z.data() + chunk.begin;
+        chunk.r = cloud.r.data() + chunk.begin;
+        chunk.g = cloud.g.data() + chunk.begin;
+        chunk.b = cloud.b.data() + chunk.begin;
+        chunk.S = S ? S + chunk.begin : NULL;
+        chunk.F = F ? F + chunk.begin : NULL;
+        return chunk;
+    }
+    
+    /*! Returns the number of points of chunk. When the cubes have unique
+        vertices and differ in their faces, offsets is filled with the first
+        point of every cube and the total at the end; otherwise each
+        cloudlet has shape.points and offsets is empty.
+     */
+    unsigned chunk_points(const Chunk& chunk, const CloudletShape& shape, std::vector<unsigned>& offsets) const
+    {
+        size_t n = chunk.size();
+        
+        offsets.clear();
+        if (!chunk.F || topology != TOPOLOGY_UNIQUE)
+            return shape.points * n;
+        
+        offsets.resize(n + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < n; i++)
+            offsets[i + 1] = offsets[i] + cloudlet_face_count(shape.faceMask & chunk.F[i]) * 6;
+        return offsets[n];
+    }
+    
+    // Same as chunk_points for the primitives of a chunk of triangles.
+    unsigned chunk_primitives(const Chunk& chunk, const CloudletShape& shape, std::vector<unsigned>& offsets) const
+    {
+        size_t n = chunk.size();
+        
+        offsets.clear();
+        if (!chunk.F)
+            return shape.primitives * n;
+        
+        offsets.resize(n + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < n; i++)
+            offsets[i + 1] = offsets[i] + cloudlet_face_count(shape.faceMask & chunk.F[i]) * 2;
+        return offsets[n];
+    }
+    
+    // Whether colors go on the primitives, which takes fewer entries than
+    // the points when every cloudlet has primitives of its own.
+    bool colors_per_primitive(const CloudletShape& shape) const
+    {
+        return compact && output != OUTPUT_INSTANCES && primitiveMode == PRIMITIVES_TRIANGLES &&
+               shape.primitives < shape.points;
+    }
+    
+    // Offsets of the points of a cloudlet with all the faces of shape.
+    void vertex_table(const CloudletShape& shape, CloudletVertexTable& table) const
+    {
+        float size = radius / resolution;
+        float right[3], up[3];
+        billboard_axes(right, up);
+        
+        if (output == OUTPUT_INSTANCES)
+            table.build_center();
+        else if (output == OUTPUT_BILLBOARDS && topology == TOPOLOGY_SHARED)
+            table.build_quad_corners(right, up, size);
+        else if (output == OUTPUT_BILLBOARDS)
+            table.build_quad(right, up, size);
+        else if (shape.solid && topology == TOPOLOGY_SHARED)
+            table.build_solid_corners(*shape.solid, size);
+        else if (shape.solid)
+            table.build_solid(*shape.solid, size);
+        else if (topology == TOPOLOGY_SHARED)
+            table.build_corners(size);
+        else
+            table.build(shape.faceMask, size);
+    }
+    
+    // Everything the points of chunk are computed from.
+    Hash chunk_point_hash(const Chunk& chunk, const CloudletShape& shape, const CloudletVertexTable& table) const
+    {
+        size_t n = chunk.size();
+        float scale[3];
+        point_scale(scale);
+        
+        Hash key;
+        key.append(shape.faceMask);
+        key.append(table.offsets, table.vertices * 3 * sizeof(float));
+        key.append(scale, sizeof(scale));
+        key.append(chunk.x, n * sizeof(float));
+        key.append(chunk.y, n * sizeof(float));
+        key.append(chunk.z, n * sizeof(float));
+        if (chunk.S)
+            key.append(chunk.S, n * sizeof(float));
+        if (chunk.F)
+            key.append(chunk.F, n);
+        return key;
+    }
     
-    unsigned columns, rows,grid_stream;
-    bool useTop, useBottom, useLeft, useRight, useFront , useBack;
+    // Everything the normals, sizes and colors of chunk are computed from,
+    // which leaves out the positions.
+    Hash chunk_attribute_hash(const Chunk& chunk, const CloudletShape& shape, const CloudletVertexTable& table) const
+    {
+        size_t n = chunk.size();
+        
+        Hash key;
+        key.append(shape.faceMask);
+        if (output == OUTPUT_BILLBOARDS)
+            key.append(table.offsets, table.vertices * 3 * sizeof(float));
+        key.append(radius);
+        key.append(resolution);
+        if (chunk.S)
+            key.append(chunk.S, n * sizeof(float));
+        if (chunk.F)
+            key.append(chunk.F, n);
+        key.append(chunk.r, n * sizeof(float));
+        key.append(chunk.g, n * sizeof(float));
+        key.append(chunk.b, n * sizeof(float));
+        return key;
+    }
     
-    // local matrix that Axis_Knob fills in
-    Matrix4 _local;
-    bool fix;
-    Knob* _pAxisKnob;
-    std::vector<cloudlet> clouds;
+    void build_primitives(GeometryList& out, int obj, const Chunk& chunk, const CloudletShape& shape)
+    {
+        std::vector<unsigned> offsets;
+        unsigned num_points = chunk_points(chunk, shape, offsets);
+        
+        if (output == OUTPUT_INSTANCES) {
+            Point::RenderMode mode = instance_modes[instanceShape];
+            float size = radius / resolution;
+            
+            for (unsigned cube = 0; cube < chunk.size(); cube++)
+                out.add_primitive(obj, new Point(mode, chunk.S ? size * chunk.S[cube] : size, cube));
+        }
+        else if (output == OUTPUT_BILLBOARDS) {
+            TriangleSink triangles(out, obj, primitiveMode == PRIMITIVES_MESH, num_points, 2 * chunk.size());
+            
+            for (unsigned cube = 0; cube < chunk.size(); cube++) {
+                unsigned base = cube * shape.points;
+                if (topology == TOPOLOGY_SHARED) {
+                    const int* c = cloudletQuadCorners;
+                    triangles.add(base + c[0], base + c[1], base + c[2]);
+                    triangles.add(base + c[3], base + c[4], base + c[5]);
+                }
+                else {
+                    triangles.add(base, base + 1, base + 2);
+                    triangles.add(base + 3, base + 4, base + 5);
+                }
+            }
+            triangles.finish();
+        }
+        else {
+            unsigned num_triangles = shape.primitives * chunk.size();
+            if (chunk.F) {
+                num_triangles = 0;
+                for (unsigned cube = 0; cube < chunk.size(); cube++)
+                    num_triangles += cloudlet_face_count(shape.faceMask & chunk.F[cube]) * 2;
+            }
+            TriangleSink triangles(out, obj, primitiveMode == PRIMITIVES_MESH, num_points, num_triangles);
+            
+            if (shape.solid && topology == TOPOLOGY_SHARED) {
+                for (unsigned cloudlet = 0; cloudlet < chunk.size(); cloudlet++) {
+                    unsigned base = cloudlet * shape.points;
+                    
+                    for (int t = 0; t < shape.solid->triangles; t++) {
+                        const int* c = shape.solid->triangleTable[t];
+                        triangles.add(base + c[0], base + c[1], base + c[2]);
+                    }
+                }
+            }
+            else if (topology == TOPOLOGY_SHARED) {
+                for (unsigned cube = 0; cube < chunk.size(); cube++) {
+                    unsigned base = cube * 8;
+                    int mask = chunk.F ? shape.faceMask & chunk.F[cube] : shape.faceMask;
+                    
+                    for (int face = 0; face < 6; face++) {
+                        if (!(mask & (1 << face)))
+                            continue;
+                        
+                        const int* c = cloudletFaceCorners[face];
+                        triangles.add(base + c[0], base + c[1], base + c[2]);
+                        triangles.add(base + c[3], base + c[4], base + c[5]);
+                    }
+                }
+            }
+            else {
+                for (int t = 0; t < num_points/3; t++) {
+                    
+                    triangles.add( (t*3) , (t*3 +1) , (t*3 +2) );
+                    
+                }
+            }
+            triangles.finish();
+        }
+    }
     
-protected:
-    void _validate(bool for_real)
+    void build_points(GeometryList& out, int obj, const Chunk& chunk, const CloudletShape& shape,
+                      const CloudletVertexTable& table)
     {
- 
-        //resolution    = MIN(MAX(resolution,    1.0), 0.1);
-        SourceGeo::_validate(for_real);
+        std::vector<unsigned> offsets;
+        unsigned num_points = chunk_points(chunk, shape, offsets);
+        
+        // Generate points:
+        PointList* points = out.writable_points(obj);
+        points->resize(num_points);
         
+        float size = (radius) / resolution;
+        
+        PointsJob job;
+        job.x = chunk.x;
+        job.y = chunk.y;
+        job.z = chunk.z;
+        job.count = chunk.size();
+        job.sizes = chunk.S;
+        job.table = table;
+        job.kernel = cloudlet_vertex_kernel();
+        point_scale(job.scale);
+        job.out = num_points ? &(*points)[0].x : NULL;
+        job.faces = NULL;
+        job.offsets = NULL;
+        
+        if (!offsets.empty()) {
+            job.faces = chunk.F;
+            job.offsets = &offsets[0];
+            job.faceTables.resize(CLOUDLET_ALL_FACES + 1);
+            for (int mask = 0; mask <= CLOUDLET_ALL_FACES; mask++)
+                job.faceTables[mask].build(shape.faceMask & mask, size);
+        }
+        
+        // Assign the point locations:
+        unsigned numThreads = MAX(Thread::numThreads, 1u);
+        if (numThreads > 1 && chunk.size() >= 65536) {
+            Thread::spawn(emit_points_range, numThreads, &job);
+            Thread::wait(&job);
+        }
+        else {
+            emit_points_range(0, 1, &job);
+        }
     }
     
-   
+    // Assigns the normals and colors of one object.
+    void build_attributes(GeometryList& out, int obj, const Chunk& chunk, const CloudletShape& shape)
+    {
+        std::vector<unsigned> offsets;
+        unsigned num_points = chunk_points(chunk, shape, offsets);
+        
+        //---------------------------------------------
+        // NORMALS:
+        if (output == OUTPUT_INSTANCES) {
+            // Instances face the camera; they carry a size instead.
+            Attribute* S = out.writable_attribute(obj, Group_Points, "size", FLOAT_ATTRIB);
+            assert(S);
+            float size = radius / resolution;
+            for (unsigned p = 0; p < num_points; p++)
+                S->flt(p) = chunk.S ? size * chunk.S[p] : size;
+        }
+        else if (compact) {
+            // Left to the renderers, from the flat triangles.
+        }
+        else if (output == OUTPUT_BILLBOARDS) {
+            // Every billboard faces the camera:
+            float right[3], up[3];
+            billboard_axes(right, up);
+            Vector3 n = Vector3(right[0], right[1], right[2]).cross(Vector3(up[0], up[1], up[2]));
+            n.normalize();
+            
+            CloudletVertexTable normals;
+            float v[3] = { n.x, n.y, n.z };
+            normals.build_constant(v, shape.points);
+            
+            Attribute* N = out.writable_attribute(obj, Group_Points, "N", NORMAL_ATTRIB);
+            assert(N);
+            cloudlet_repeat_tables(&normals, NULL, chunk.size(), (float*)N->array());
+        }
+        else {
+            // Flat shaded faces. Shared corners belong to up to three
+            // faces, so there the normals go on the vertices, which are
+            // laid out like the points of unique cubes.
+            std::vector<CloudletVertexTable> normals(chunk.F ? CLOUDLET_ALL_FACES + 1 : 1);
+            for (size_t mask = 0; mask < normals.size(); mask++) {
+                if (shape.solid)
+                    normals[mask].build_solid_normals(*shape.solid);
+                else
+                    normals[mask].build_normals(chunk.F ? shape.faceMask & mask : shape.faceMask);
+            }
+            
+            GroupType group = (topology == TOPOLOGY_SHARED) ? Group_Vertices : Group_Points;
+            Attribute* N = out.writable_attribute(obj, group, "N", NORMAL_ATTRIB);
+            assert(N);
+            cloudlet_repeat_tables(&normals[0], chunk.F, chunk.size(), (float*)N->array());
+        }
+        
+        //---------------------------------------------
+        // CF:
+
+        if (colors_per_primitive(shape)) {
+            std::vector<unsigned> primitives;
+            chunk_primitives(chunk, shape, primitives);
+            
+            Attribute* cf = out.writable_attribute(obj, Group_Primitives, "Cf", VECTOR4_ATTRIB);
+            assert(cf);
+            cloudlet_fill_colors(chunk.r, chunk.g, chunk.b, chunk.size(), shape.primitives,
+                                 primitives.empty() ? NULL : &primitives[0], (float*)cf->array());
+        }
+        else {
+            Attribute* cf = out.writable_attribute(obj, Group_Points, "Cf", VECTOR4_ATTRIB);
+            assert(cf);
+            cloudlet_fill_colors(chunk.r, chunk.g, chunk.b, chunk.size(), shape.points,
+                                 offsets.empty() ? NULL : &offsets[0], (float*)cf->array());
+        }
+        
+        
+        /*
+        //---------------------------------------------
+        // UVs:
+        const Primitive** PRIMS = info.primitive_array();
+        
+        Attribute* uv = out.writable_attribute(obj, Group_Vertices, "uv", VECTOR4_ATTRIB);
+         
+        assert(uv);
+        
+        float ds = (360.0f / float(my_u_extent)) / float(columns); // U change per column
+        float ss = 0.5f - (360.0f / float(my_u_extent)) / 2.0f;     // Starting U
+        float dt = (180.0f / float(my_v_extent)) / float(rows);     // V change per row
+        float st = 0.5 - (180.0 / my_v_extent) / 2.0;              // Starting V
+        float s, t;                                             // Current UV
+        t = st;
+        // Bottom center:
+        if (close_bottom) {
+            s = ss;
+            for (int i = 0; i < columns; i++) {
+                unsigned v = (*PRIMS++)->vertex_offset();
+                
+                uv->vector4(v++).set(   s, 0.0f, 0.0f, 1.0f);
+             
+                
+                uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
+                
+                uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
+               
+                s += ds;
+            }
+            t += dt;
+        }
+        
+        // Create the poly mesh in center:
+        for (int j = 0; j < rows - 2; j++) {
+            s = ss;
+            for (int i = 0; i < columns; i++) {
+                unsigned v = (*PRIMS++)->vertex_offset();
+                uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
+                uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
+                uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
+                v = (*PRIMS++)->vertex_offset();
+                uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
+                uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
+                uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
+                s += ds;
+            }
+            t += dt;
+        }
+        
+        // Top endcap:
+        if (close_top) {
+            s = ss;
+            for (int i = 0; i < columns; i++) {
+                unsigned v = (*PRIMS++)->vertex_offset();
+                uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
+                uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
+                uv->vector4(v++).set(   s, 1.0f, 0.0f, 1.0f);
+                s += ds;
+            }
+        }*/
+    }
     
 public:
     static const Description description;
@@ -64,7 +2026,11 @@ public:
     }
     int maximum_inputs() const
     {
-        return 2;
+#ifdef CLOUDLIGHT_DEEP
+        return 4;
+#else
+        return 3;
+#endif
     }
     
     const char* input_label(int input, char* buffer) const
@@ -73,9 +2039,46 @@ public:
             default: return "";
             case 0: return "colorMap";
             case 1: return "pointMap";
+            case 2: return "camera";
+            case 3: return "deep";
         }
     }
     
+    // The camera and deep inputs are optional and only accept cameras and
+    // deep images.
+    bool test_input(int input, Op* op) const
+    {
+        if (input == 2)
+            return dynamic_cast<CameraOp*>(op) != NULL;
+#ifdef CLOUDLIGHT_DEEP
+        if (input == 3)
+            return dynamic_cast<DeepOp*>(op) != NULL;
+#endif
+        return SourceGeo::test_input(input, op);
+    }
+    
+    Op* default_input(int input) const
+    {
+        if (input >= 2)
+            return NULL;
+        return SourceGeo::default_input(input);
+    }
+    
+    // While accumulating, the maps and the deep image are pulled once per
+    // frame of the range.
+    int split_input(int input) const
+    {
+        return input != 2 ? frame_count() : 1;
+    }
+    
+    const OutputContext& inputContext(int input, int offset, OutputContext& context) const
+    {
+        context = outputContext();
+        if (accumulate && input != 2)
+            context.setFrame(firstFrame + offset);
+        return context;
+    }
+    
   
   
     cloudLight1(Node* node) : SourceGeo(node)
@@ -84,10 +2087,42 @@ public:
         resolution =0.25;
         radius = 1.0;
         rows = columns = 10;
+        gridColumns = gridRows = 0;
         useTop= useLeft = useRight = useFront = true;
         useBottom = useBack = false;
+        topology = TOPOLOGY_UNIQUE;
+        primitiveMode = PRIMITIVES_TRIANGLES;
+        output = OUTPUT_CUBES;
+        solidShape = SHAPE_CUBE;
+        instanceShape = 1;
+        cacheDir = NULL;
+        cull = false;
+        cullMargin = 0.1;
+        lod = false;
+        lodPixels = 4.0;
+        hideFaces = false;
+        faceTolerance = 0.25;
+        order = ORDER_PIXELS;
+        chunkSize = 0;
+        compact = false;
+        accumulate = false;
+        firstFrame = 1;
+        lastFrame = 100;
+        voxelSize = 0.0;
+        deepPosition[0] = deepPosition[1] = deepPosition[2] = Chan_Black;
+        cloudsKey = 0;
+        cloudsExtraction = 0;
+        sourceFailed = false;
+        droppedBuilds = 0;
+        cloudsValid = false;
+        octreeValid = false;
+        staging = false;
         useLuma=false;
         depth=1.0;
+        sampling = SAMPLING_UNIFORM;
+        budget = 100000;
+        maxCloudlets = 0;
+        importance = IMPORTANCE_ALPHA;
         
         _local.makeIdentity();
         fix = false;
@@ -100,10 +2135,74 @@ public:
         
         Double_knob(f, &resolution, "resolution","Resolution %");
         Double_knob(f, &radius, "radius","Cloudlet Scale");
+        Enumeration_knob(f, &sampling, sampling_types, "sampling", "Sampling");
+        Tooltip(f, "uniform: one cloudlet for every solid sample of the resolution grid.\n"
+                   "adaptive: at most budget cloudlets; grid areas where the colors or "
+                   "positions vary get small cubes and flat areas large ones. The whole "
+                   "resolution grid is held while sampling, about 50 bytes per sample, "
+                   "whatever the budget.\n"
+                   "voxel: the solid samples of the resolution grid are binned into "
+                   "world space voxels and each occupied voxel becomes one cloudlet with "
+                   "their average position and color, so density is even in 3D rather "
+                   "than on screen.");
+        Int_knob(f, &budget, "budget", "Budget");
+        Double_knob(f, &voxelSize, "voxelSize", "Voxel size");
+        Tooltip(f, "Edge of the voxels of voxel sampling and frame accumulation, in "
+                   "pointMap units; 0 uses the size of a cloudlet cube.");
+        Int_knob(f, &maxCloudlets, "max_cloudlets", "Max cloudlets");
+        Tooltip(f, "Hard cap on the number of uniformly sampled cloudlets and voxels; 0 "
+                   "means no cap. When there are more, the ones with the highest importance "
+                   "are kept. Voxels all have an alpha of 1.");
+        Enumeration_knob(f, &importance, importance_types, "importance", "Importance");
+        Enumeration_knob(f, &output, output_types, "output", "Output");
+        Tooltip(f, "cubes: every cloudlet is expanded into cube triangles.\n"
+                   "instances: every cloudlet is a single point primitive carrying "
+                   "position, Cf and size; its shape is drawn at render time.\n"
+                   "billboards: every cloudlet is a square of 2 triangles facing the "
+                   "camera input, or facing +z without a camera.");
+        Enumeration_knob(f, &instanceShape, instance_types, "instanceShape", "Instance");
+        Enumeration_knob(f, &solidShape, shape_types, "shape", "Shape");
+        Tooltip(f, "Solid of cubes output. A tetrahedron takes 4 triangles and an "
+                   "octahedron 8 instead of the 12 of a cube; both ignore the face "
+                   "selection. Single quads and points are the billboards and "
+                   "instances outputs.");
         Divider( f);
         Bool_knob(f, &useLuma, "useLuma"  , "Use PointPass luma as depth");
         Newline(f);
         Double_knob(f, &depth, "depth","Depth scale");
+#ifdef CLOUDLIGHT_DEEP
+        Input_Channel_knob(f, deepPosition, 3, 3, "deepPosition", "Deep position");
+        Tooltip(f, "With a deep image connected, every solid deep sample of a grid pixel "
+                   "becomes a cloudlet, not just the front-most surface, and the maps are "
+                   "ignored. Positions are read from these channels; when they are none, "
+                   "samples sit at their grid pixel with the deep front, times Depth scale, "
+                   "as z. Adaptive sampling falls back to uniform.");
+#endif
+        Divider( f);
+        File_knob(f, &cacheDir, "cacheDir", "Cache directory");
+        Tooltip(f, "When set, extracted clouds are stored in this directory keyed by "
+                   "the input hashes and extraction knobs, and later rebuilds, script "
+                   "loads and farm renders map the file instead of sampling the inputs. "
+                   "Only full extractions are written; clouds refreshed in place while "
+                   "the inputs change, e.g. when scrubbing, are not.");
+        Divider( f);
+        Bool_knob(f, &accumulate, "accumulate", "Accumulate frames");
+        Int_knob(f, &firstFrame, "firstFrame", "First frame");
+        Int_knob(f, &lastFrame, "lastFrame", "Last frame");
+        Tooltip(f, "Builds one static cloud from every frame of the range instead of the "
+                   "current frame. Solid samples that land in the same voxel are averaged "
+                   "into one cloudlet, whatever the sampling.");
+        Divider( f);
+        Bool_knob(f, &cull, "cull", "Cull to camera");
+        Double_knob(f, &cullMargin, "cullMargin", "Cull margin");
+        Tooltip(f, "With a camera connected, cloudlets outside its frame are dropped "
+                   "before any geometry is made. The margin grows the frame on every "
+                   "side, as a fraction of its width, to keep cubes that straddle the edge.");
+        Bool_knob(f, &lod, "lod", "Level of detail");
+        Double_knob(f, &lodPixels, "lodPixels", "LOD pixels");
+        Tooltip(f, "With a camera connected, cloudlets far enough from it to cover fewer "
+                   "than this many pixels are merged into larger cubes with their average "
+                   "position and color, so cubes stay about this size on screen.");
         Divider( f);
         
         Text_knob(f, "Select wich faces to draw:");
@@ -113,6 +2212,37 @@ public:
         Bool_knob(f, &useBottom, "useBottom" , "Bottom");
         Bool_knob(f, &useLeft, "useLeft"   , "Left");
         Bool_knob(f, &useRight, "useRight"  , "Right");
+        Bool_knob(f, &hideFaces, "hideFaces", "Remove hidden faces");
+        Double_knob(f, &faceTolerance, "faceTolerance", "Face tolerance");
+        Tooltip(f, "Drops the faces between cubes of neighbouring pixels that touch. "
+                   "Cubes touch when they are at most one cube apart along one axis and "
+                   "off by at most this fraction of a cube on the other two. Only cubes "
+                   "of uniformly sampled clouds lose faces.");
+        Enumeration_knob(f, &topology, topology_types, "topology", "Topology");
+        Tooltip(f, "unique vertices: every triangle has its own 3 points.\n"
+                   "shared vertices: each cloudlet has 8 corner points that its "
+                   "triangles index into; normals are stored per vertex.");
+        Enumeration_knob(f, &order, order_types, "order", "Order");
+        Tooltip(f, "pixels: cloudlets are emitted in scanline order of the colorMap.\n"
+                   "morton: cloudlets are emitted along a Z-order curve through their "
+                   "positions, so cubes that are close in space are close in the point, "
+                   "primitive and attribute arrays.");
+        Enumeration_knob(f, &primitiveMode, primitive_types, "primitives", "Primitives");
+        Tooltip(f, "triangles: one Triangle primitive per cube triangle.\n"
+                   "single mesh: all cube triangles are faces of one PolyMesh, "
+                   "allocated in bulk.");
+        Bool_knob(f, &compact, "compact", "Compact attributes");
+        Tooltip(f, "Leaves out the normals of cubes and billboards, whose flat "
+                   "triangles are wound outward and so already give renderers the face "
+                   "normals, and stores one color per primitive instead of per point "
+                   "when that is fewer.");
+        Int_knob(f, &chunkSize, "chunkSize", "Chunk size");
+        Tooltip(f, "Splits the output into one object per square tile of this many "
+                   "resolution grid cells a side; 0 keeps a single object. Point and "
+                   "color updates, e.g. a new frame, skip the objects whose cloudlets did "
+                   "not change, but anything that rebuilds the cubes, culling and LOD "
+                   "included, recreates every object. The whole cloud is still held in "
+                   "memory.");
         Divider( f);
         Text_knob(f, "Cloud Light V2012.1 ( hassan.uriostegui@gmail.com )");
         
@@ -149,18 +2279,109 @@ public:
         return SourceGeo::knob_changed(k);
     }
     
+    /*! Hash of which samples of the resolution grid are solid in the
+        colorMap. A cache file of the cloud already lists them; otherwise
+        the colorMap alpha is scanned on all threads. Both hash the solid
+        pixel indices row by row, so they agree. It is kept until the
+        colorMap or the resolution change.
+     */
+    const Hash& coverage_hash()
+    {
+        Iop* colorMap = color_map();
+        colorMap->validate(true);
+        
+        Hash key;
+        key.append(colorMap->hash());
+        key.append(resolution);
+        if (key == coverageKey)
+            return coverage;
+        
+        CoverageJob job;
+        job.columns = colorMap->w();
+        job.rows = colorMap->h();
+        job.gridColumns = (int)ceil(job.columns * resolution);
+        job.scale = 1.0 / resolution;
+        int numRows = (int)ceil(job.rows * resolution);
+        job.rowHashes.resize(MAX(numRows, 0));
+        
+        CloudletArray<int> pixels;
+        if (use_cache() && cloudlet_cache_load_pixels(cacheDir, cache_key(), job.gridColumns, numRows, pixels)) {
+            const int* P = pixels.data();
+            size_t n = pixels.size();
+            size_t end = 0;
+            for (int y = 0; y < numRows; y++) {
+                size_t begin = end;
+                while (end < n && P[end] < (y + 1) * job.gridColumns)
+                    end++;
+                job.rowHashes[y] = pixel_row_hash(P + begin, end - begin);
+            }
+        }
+        else {
+            colorMap->request(0, 0, job.columns, job.rows, Mask_Alpha, 0);
+            job.colorMap = colorMap;
+            job.pointMap = NULL;
+#ifdef CLOUDLIGHT_DEEP
+            job.deep = NULL;
+#endif
+            run_bands(job, coverage_band, numRows);
+            colorMap->close();
+        }
+        
+        Hash signature;
+        signature.append(job.gridColumns);
+        signature.append(numRows);
+        for (int y = 0; y < numRows; y++)
+            signature.append(job.rowHashes[y]);
+        
+        coverage = signature;
+        if (!aborted())
+            coverageKey = key;
+        return coverage;
+    }
+    
+    // Fills the row hashes of job for the grid rows [y0, y1).
+    void coverage_rows(CoverageJob& job, int y0, int y1)
+    {
+        Row row(0, job.columns);
+        std::vector<int> solid;
+        
+        for (int y = y0; y < y1; y++) {
+            if (aborted())
+                return;
+            
+            job.colorMap->get(MIN((int)(y * job.scale), job.rows - 1), 0, job.columns, Mask_Alpha, row);
+            const float* alpha = row[Chan_Alpha];
+            
+            solid.clear();
+            for (int x = 0; x < job.gridColumns; x++) {
+                if (alpha[MIN((int)(x * job.scale), job.columns - 1)] > 0.5f)
+                    solid.push_back(y * job.gridColumns + x);
+            }
+            job.rowHashes[y] = pixel_row_hash(solid.empty() ? NULL : &solid[0], solid.size());
+        }
+    }
+    
+    // Hash of the solid pixel indices of one grid row.
+    static Hash pixel_row_hash(const int* P, size_t n)
+    {
+        Hash hash;
+        hash.append((int)n);
+        if (n)
+            hash.append(P, n * sizeof(int));
+        return hash;
+    }
+    
     // Hash up knobs that affect the cloudLight1:
     void get_geometry_hash()
     {
         SourceGeo::get_geometry_hash();   // Get all hashes up-to-date
         
-        Iop* colorMap = (Iop*)input0();
-        Iop* pointMap = (Iop*)input1();
+        Iop* colorMap = color_map();
+        Iop* pointMap = point_map();
         
-        // Knobs that change the geometry structure:
-        geo_hash[Group_Primitives].append(outputContext().frame());
-        geo_hash[Group_Primitives].append(colorMap->hash());
-        geo_hash[Group_Primitives].append(pointMap->hash());
+        // Knobs that change the geometry structure. The frame is not one of
+        // them: a new frame refreshes the cloud in place and only rebuilds
+        // the primitives when the set of solid pixels differs.
         
         geo_hash[Group_Primitives].append(useTop);
         geo_hash[Group_Primitives].append(useBottom);
@@ -168,6 +2389,14 @@ public:
         geo_hash[Group_Primitives].append(useBack);
         geo_hash[Group_Primitives].append(useLeft);
         geo_hash[Group_Primitives].append(useRight);
+        geo_hash[Group_Primitives].append(topology);
+        geo_hash[Group_Primitives].append(primitiveMode);
+        geo_hash[Group_Primitives].append(compact);
+        geo_hash[Group_Primitives].append(order);
+        geo_hash[Group_Primitives].append(chunkSize);
+        geo_hash[Group_Primitives].append(output);
+        geo_hash[Group_Primitives].append(instanceShape);
+        geo_hash[Group_Primitives].append(solidShape);
         
         
         geo_hash[Group_Primitives].append(useLuma);
@@ -175,10 +2404,70 @@ public:
     
         geo_hash[Group_Primitives].append(resolution);
         geo_hash[Group_Primitives].append(radius);
+        geo_hash[Group_Primitives].append(sampling);
+        geo_hash[Group_Primitives].append(budget);
+        geo_hash[Group_Primitives].append(maxCloudlets);
+        geo_hash[Group_Primitives].append(droppedBuilds);
+        geo_hash[Group_Primitives].append(importance);
+        geo_hash[Group_Primitives].append(voxelSize);
+        
+        // An accumulated cloud is built from every frame of its range:
+        if (accumulate) {
+            geo_hash[Group_Primitives].append(firstFrame);
+            geo_hash[Group_Primitives].append(lastFrame);
+            for (int m = 0; m < frame_count(); m++) {
+                geo_hash[Group_Primitives].append(color_map(m)->hash());
+                geo_hash[Group_Primitives].append(point_map(m)->hash());
+            }
+        }
+        
+        // Which pixels become cloudlets. A uniform cloud only depends on the
+        // colorMap alpha coverage, so grades that keep it skip the rebuild;
+        // the other samplings pick their cloudlets from the map contents:
+        if (!accumulate && !use_deep()) {
+            if (sampling_mode() != SAMPLING_UNIFORM) {
+                geo_hash[Group_Primitives].append(colorMap->hash());
+                geo_hash[Group_Primitives].append(pointMap->hash());
+            }
+            else if (maxCloudlets > 0)
+                geo_hash[Group_Primitives].append(colorMap->hash());
+            else
+                geo_hash[Group_Primitives].append(coverage_hash());
+        }
+        
+        // The number of deep samples changes with every deep image:
+        if (use_deep()) {
+            for (int m = 0; m < frame_count(); m++)
+                geo_hash[Group_Primitives].append(deep_input(m)->hash());
+            for (int a = 0; a < 3; a++)
+                geo_hash[Group_Primitives].append(deepPosition[a]);
+        }
+        
+        // Stages that pick cloudlets or faces by their position make the
+        // positions part of the structure:
+        if (culling_camera() || lod_camera() || hiding_faces())
+            geo_hash[Group_Primitives].append(pointMap->hash());
+        if (hiding_faces()) {
+            geo_hash[Group_Primitives].append(hideFaces);
+            geo_hash[Group_Primitives].append(faceTolerance);
+        }
         
-        // Knobs that change the point locations:
-        //geo_hash[Group_Points].append(outputContext().frame());
-        geo_hash[Group_Points].append(colorMap->hash());
+        // Culling and LOD also depend on where they land in the camera:
+        if (culling_camera() || lod_camera()) {
+            geo_hash[Group_Primitives].append(camera()->hash());
+            append_matrix(geo_hash[Group_Primitives], _local);
+            
+            geo_hash[Group_Primitives].append(cull);
+            geo_hash[Group_Primitives].append(cullMargin);
+            geo_hash[Group_Primitives].append(lod);
+            geo_hash[Group_Primitives].append(lodPixels);
+        }
+        
+        // Knobs that change the point locations. Only the pointMap is
+        // hashed here; the colorMap alpha is covered by the primitives. An
+        // accumulated cloud is the same on every frame:
+        if (!accumulate)
+            geo_hash[Group_Points].append(outputContext().frame());
         geo_hash[Group_Points].append(pointMap->hash());
         
         geo_hash[Group_Points].append(resolution);
@@ -194,35 +2483,51 @@ public:
         geo_hash[Group_Points].append(useLuma);
         geo_hash[Group_Points].append(depth);
         
-        geo_hash[Group_Matrix].append(_local.a00);
-        geo_hash[Group_Matrix].append(_local.a01);
-        geo_hash[Group_Matrix].append(_local.a02);
-        geo_hash[Group_Matrix].append(_local.a03);
+        // Billboards turn with the camera:
+        if (output == OUTPUT_BILLBOARDS && camera()) {
+            geo_hash[Group_Points].append(camera()->hash());
+            append_matrix(geo_hash[Group_Points], _local);
+        }
+        
+        // The colorMap only changes the Cf attribute:
+        if (!accumulate)
+            geo_hash[Group_Attributes].append(outputContext().frame());
+        geo_hash[Group_Attributes].append(colorMap->hash());
+        
+        append_matrix(geo_hash[Group_Matrix], _local);
+    }
+    
+    static void append_matrix(DD::Image::Hash& hash, const Matrix4& m)
+    {
+        hash.append(m.a00);
+        hash.append(m.a01);
+        hash.append(m.a02);
+        hash.append(m.a03);
         
-        geo_hash[Group_Matrix].append(_local.a10);
-        geo_hash[Group_Matrix].append(_local.a11);
-        geo_hash[Group_Matrix].append(_local.a12);
-        geo_hash[Group_Matrix].append(_local.a13);
+        hash.append(m.a10);
+        hash.append(m.a11);
+        hash.append(m.a12);
+        hash.append(m.a13);
         
-        geo_hash[Group_Matrix].append(_local.a20);
-        geo_hash[Group_Matrix].append(_local.a21);
-        geo_hash[Group_Matrix].append(_local.a22);
-        geo_hash[Group_Matrix].append(_local.a23);
+        hash.append(m.a20);
+        hash.append(m.a21);
+        hash.append(m.a22);
+        hash.append(m.a23);
         
-        geo_hash[Group_Matrix].append(_local.a30);
-        geo_hash[Group_Matrix].append(_local.a31);
-        geo_hash[Group_Matrix].append(_local.a32);
-        geo_hash[Group_Matrix].append(_local.a33);
+        hash.append(m.a30);
+        hash.append(m.a31);
+        hash.append(m.a32);
+        hash.append(m.a33);
     }
     
     void append(DD::Image::Hash& hash)
     {
          //hash.append(outputContext().frame());
         
-        Iop* colorMap = (Iop*)input0();
+        Iop* colorMap = color_map();
         hash.append(colorMap->hash());
         
-        Iop* pointMap = (Iop*)input1();
+        Iop* pointMap = point_map();
         hash.append(pointMap->hash());
     }
 
@@ -238,11 +2543,50 @@ public:
             out[i].matrix = _local * out[i].matrix;
     }
     
+    /*! Staging, hidden face search and geometry generation allocate in
+        proportion to the cloud just like extraction, so running out of
+        memory anywhere reports an error and leaves an empty cloud and no
+        objects instead of throwing out of create_geometry. The next cook
+        then rebuilds everything rather than keeping the empty result.
+     */
     void create_geometry(Scene& scene, GeometryList& out)
     {
-                
-  
-        int obj = 0;
+        try {
+            build_geometry(scene, out);
+        }
+        catch (const std::bad_alloc&) {
+            error("Out of memory building the cloud geometry; lower the resolution or set max_cloudlets.");
+            drop_geometry(out);
+            droppedBuilds++;
+        }
+    }
+    
+    // Releases the cloud and everything made from it. clear() keeps the
+    // storage, so each buffer is swapped with an empty one instead.
+    void drop_geometry(GeometryList& out)
+    {
+        CloudletBuffer().swap(clouds);
+        CloudletArray<float>().swap(cloudSizes);
+        CloudletArray<unsigned char>().swap(cloudFaces);
+        CloudletOctree().swap(octree);
+        cloudsValid = false;
+        octreeValid = false;
+        staging = false;
+        CloudletBuffer().swap(staged);
+        CloudletArray<float>().swap(stagedSizes);
+        CloudletArray<unsigned char>().swap(stagedFaces);
+        std::vector<unsigned>().swap(chunkOrder);
+        CloudletBuffer().swap(chunkCloud);
+        CloudletArray<float>().swap(chunkSizes);
+        CloudletArray<unsigned char>().swap(chunkFaces);
+        chunkStarts.assign(1, 0);
+        chunkPointHashes.clear();
+        chunkAttributeHashes.clear();
+        out.delete_objects();
+    }
+    
+    void build_geometry(Scene& scene, GeometryList& out)
+    {
         //=============================================================
         // Calculate number of visible faces
         int cube_faces = 0; 
@@ -253,300 +2597,173 @@ public:
         if(useBottom) cube_faces++;
         if(useLeft) cube_faces++;
         if(useRight) cube_faces++;
+        
+        int face_mask = 0;
+        
+        if(useBack) face_mask |= CLOUDLET_BACK;
+        if(useFront) face_mask |= CLOUDLET_FRONT;
+        if(useTop) face_mask |= CLOUDLET_TOP;
+        if(useBottom) face_mask |= CLOUDLET_BOTTOM;
+        if(useLeft) face_mask |= CLOUDLET_LEFT;
+        if(useRight) face_mask |= CLOUDLET_RIGHT;
         //=============================================================
         // Calculate neededPoints
         
         unsigned cube_points   = cube_faces * (2 * 3); //2 triangles per face
-        unsigned num_points  = cube_points*clouds.size();
+        
+        //Shared topology keeps just the 8 corners of every cube,
+        //instances a single point
+        unsigned cloudlet_points = (topology == TOPOLOGY_SHARED) ? 8 : cube_points;
+        if (output == OUTPUT_INSTANCES)
+            cloudlet_points = 1;
+        if (output == OUTPUT_BILLBOARDS)
+            cloudlet_points = (topology == TOPOLOGY_SHARED) ? 4 : 6;
+        
+        CloudletShape shape;
+        shape.faceMask = face_mask;
+        shape.points = cloudlet_points;
+        shape.primitives = cube_faces * 2;
+        if (output == OUTPUT_INSTANCES)
+            shape.primitives = 1;
+        if (output == OUTPUT_BILLBOARDS)
+            shape.primitives = 2;
+        shape.solid = cloudlet_solid();
+        if (shape.solid) {
+            shape.points = (topology == TOPOLOGY_SHARED) ? shape.solid->corners : shape.solid->triangles * 3;
+            shape.primitives = shape.solid->triangles;
+        }
+        
+        //=============================================================
+        // Input and frame changes that keep the primitive hash only touch
+        // the points or attributes. Both maps are refreshed in the same
+        // pass when both changed. The primitives are still rebuilt if the
+        // refresh fails anyway, e.g. on a cache of other pixels. A cloud
+        // that still matches the inputs, e.g. under a moving camera, is
+        // kept:
+        if (!rebuild(Mask_Primitives) && rebuild(Mask_Points | Mask_Attributes) && !clouds_match()) {
+            std::vector<size_t> chunks = chunkStarts;
+            bool refreshed = false;
+            try {
+                refreshed = refresh_clouds(rebuild(Mask_Points), rebuild(Mask_Attributes));
+            }
+            catch (const std::bad_alloc&) {
+                cloudsValid = false;
+            }
+            
+            if (!refreshed)
+                set_rebuild(Mask_Primitives);
+            else {
+                stage_clouds();
+                if (chunkStarts != chunks)
+                    set_rebuild(Mask_Primitives);
+                
+                // New positions can reorder the cloudlets, and their
+                // colors with them:
+                if (order == ORDER_MORTON && rebuild(Mask_Points))
+                    set_rebuild(Mask_Attributes);
+            }
+        }
         
         //=============================================================
         // Build the cloud & primitives:
         if (rebuild(Mask_Primitives)) {
             
-            //Free cloudlets
-            clouds.clear();
-            
-            //Prepare maps
-            Iop* colorMap = (Iop*)input0();
-            colorMap->validate(true);
-            colorMap->request(0, 0,  colorMap->w(),  colorMap->h(), Mask_RGBA, 0);
-            
-            Iop* pointMap = (Iop*)input1();
-            pointMap->validate(true);
-            pointMap->request(0, 0,  pointMap->w(),  pointMap->h(), Mask_RGBA, 0);
-            
-            //Get dimensions
-            rows=colorMap->h();
-            columns=colorMap->w();
+            //Prepare maps and get dimensions
+            request_source(0, columns, rows);
             grid_stream = rows*columns;
             
-            //Prepare receivers
-            Pixel colorPixel(Mask_RGBA);
-            Pixel pointPixel(Mask_RGBA); 
-            
+            //Sample grid: one cloudlet candidate every 1/resolution pixels
             float scale = 1.0 / resolution;
+            gridColumns = (int)ceil(columns * resolution);
+            gridRows = (int)ceil(rows * resolution);
             
-            for( int x=0; x< (columns*resolution); x++){
-                for( int y=0; y<(rows*resolution); y++){
-                    
-                    colorMap->sample(x*scale,y*scale,1,1,colorPixel);
-                    pointMap->sample(x*scale,y*scale,1,1,pointPixel);
-                    
-                    if(colorPixel[Chan_Alpha] > 0.5 ){
-                        //only create if its solid
-                        cloudlet CL;
-                        
-                        CL.r= colorPixel[Chan_Red];
-                        CL.g= colorPixel[Chan_Green];
-                        CL.b= colorPixel[Chan_Blue];
-                        
-                        CL.x= pointPixel[Chan_Red];
-                        CL.y= pointPixel[Chan_Green];
-                        CL.z= pointPixel[Chan_Blue];
-                        
-                        if(useLuma){
-                            float lum = (CL.x+CL.y+CL.z)/3.0f;
-                        
-                            CL.x= x;
-                            CL.y= y ;                      
-                            CL.z= lum * ((columns +rows)/10.0f);
-                        } 
-                        
-                        CL.p= ( y*colorMap->h() ) +x;
-                        clouds.push_back(CL);
+            sourceColumns.resize(gridColumns);
+            for (int x = 0; x < gridColumns; x++)
+                sourceColumns[x] = MIN((int)(x * scale), (int)columns - 1);
+            
+            // Knob changes that keep the inputs, like the faces or the
+            // camera, reuse the extracted cloud, and a cloud of the same
+            // pixels of other inputs is refreshed before it is extracted
+            // again:
+            bool refreshed = clouds_match();
+            if (!refreshed && clouds_refreshable()) {
+                try {
+                    refreshed = refresh_clouds(true, true);
+                }
+                catch (const std::bad_alloc&) {
+                    cloudsValid = false;
+                }
+                octreeValid = false;
+            }
+            
+            if (!refreshed) {
+                sourceFailed = false;
+                try {
+                    if (sampling_mode() == SAMPLING_ADAPTIVE)
+                        extract_adaptive();
+                    else if (load_cache(clouds))
+                        cloudSizes.clear();
+                    else {
+                        if (voxelized())
+                            extract_voxels();
+                        else if (maxCloudlets > 0)
+                            extract_capped();
+                        else
+                            extract_clouds();
+                        save_cache();
                     }
-                    
-                    colorPixel.erase();
-                    pointPixel.erase();
-                    
+                    remember_clouds();
                 }
+                catch (const std::bad_alloc&) {
+                    error("Out of memory extracting the cloud; lower the resolution or set max_cloudlets.");
+                    clouds.clear();
+                    cloudSizes.clear();
+                    cloudsValid = false;
+                }
+                octreeValid = false;
             }
-            colorMap->close();
-            pointMap->close();
             
-            out.delete_objects();
-            out.add_object(obj);
+            close_source(0);
             
-            //Update points number
-            num_points  = cube_points*clouds.size();
-           
-            //Populate primitives
-            for (int t = 0; t < num_points/3; t++) {
-                
-                out.add_primitive(obj, new Triangle( (t*3) , (t*3 +1) , (t*3 +2) ));       
-    
+            stage_clouds();
+            
+            out.delete_objects();
+            for (int c = 0; c < chunk_count(); c++) {
+                out.add_object(c);
+                build_primitives(out, c, emitted_chunk(c), shape);
             }
-
+            chunkPointHashes.assign(chunk_count(), Hash());
+            chunkAttributeHashes.assign(chunk_count(), Hash());
             
             // Force points and attributes to update:
             set_rebuild(Mask_Points | Mask_Attributes);
         }
         
-        
-        
         //=============================================================
-        // Create points and assign their coordinates:
-        if (rebuild(Mask_Points)) {
-            // Generate points:
-            PointList* points = out.writable_points(obj);
-            points->resize(num_points);
-            
-            float scale = 1.0;
-            
-            int p=0;
-           
-            float size = (radius) / resolution;
-            float center = size/2.0f;
-
-           
-            
-            // Assign the point locations:
-            for (int cube = 0; cube < clouds.size(); cube++) {
-                
-                cloudlet cloud=clouds[cube];
-                
-                //fixed big mistake of iint data type
+        // Create points and assign their coordinates, normals and colors.
+        // Objects whose cloudlets did not change are left alone:
+        if (rebuild(Mask_Points | Mask_Attributes)) {
+            CloudletVertexTable table;
+            vertex_table(shape, table);
             
-                float x=cloud.x;
-                float y=cloud.y;
-                float z=cloud.z;
-                
-                if(useLuma ){
-                    x=cloud.x * (1.0/resolution);
-                    y=cloud.y * (1.0/resolution);
-                    z=cloud.z * depth;
-                }
-                
-                //BACK
-                if(useBack){
-                    (*points)[ p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[ p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[ p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    
-                    (*points)[ p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[ p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[ p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                }
-                //FRONT
-                if(useFront){
-                    (*points)[ p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[ p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[ p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                    
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                }
+            for (int c = 0; c < chunk_count(); c++) {
+                Chunk chunk = emitted_chunk(c);
                 
-                //TOP
-                if(useTop){
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                }
-                //BOTTOM
-                if(useBottom){
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                }
-                //LEFT
-                if(useLeft){
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( 0.0f -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
-                }
-                //RIGHT
-                if(useRight){
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( 0.0f -center ) *scale ), z  + (( size -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( 0.0f -center ) *scale ));
-                    (*points)[  p++].set( x + (( size -center ) *scale ) ,y + (( size -center ) *scale ), z  + (( size -center ) *scale ));
+                if (rebuild(Mask_Points)) {
+                    Hash key = chunk_point_hash(chunk, shape, table);
+                    if (key != chunkPointHashes[c]) {
+                        build_points(out, c, chunk, shape, table);
+                        chunkPointHashes[c] = key;
+                    }
                 }
                 
-
-
-                //p+=36;
-            }
-        }
-        
-        //=============================================================
-        // Assign the normals and uvs:
-        if (rebuild(Mask_Attributes)) {
-            GeoInfo& info = out[obj];
-            //---------------------------------------------
-            // NORMALS:
-            const Vector3* PNTS = info.point_array();
-            Attribute* N = out.writable_attribute(obj, Group_Points, "N", NORMAL_ATTRIB);
-            assert(N);
-            for (unsigned p = 0; p < num_points; p++)
-                N->normal(p) = PNTS[p] / radius;
-            
-            //---------------------------------------------
-            // CF:
-
-            Attribute* cf = out.writable_attribute(obj, Group_Points, "Cf", VECTOR4_ATTRIB);
-            assert(cf);
-
-             
-            int rowLenght = columns * cube_points;
-            
-            for (unsigned cube = 0; cube < clouds.size(); cube++){
-                
-                cloudlet cloud=clouds[cube];
-                
-                float r=cloud.r;
-                float g=cloud.g;
-                float b=cloud.b;
-                
-                for(int i=0; i<cube_points; i++){
-                    int p = (cube*cube_points)+i;
-                    
-                    cf->vector4(p).set(   
-                                       r, 
-                                       g, 
-                                       b, 1.0f);
+                // New positions alone keep the normals and colors:
+                Hash key = chunk_attribute_hash(chunk, shape, table);
+                if (key != chunkAttributeHashes[c]) {
+                    build_attributes(out, c, chunk, shape);
+                    chunkAttributeHashes[c] = key;
                 }
-
             }
-            
-            
-            /*
-            //---------------------------------------------
-            // UVs:
-            const Primitive** PRIMS = info.primitive_array();
-            
-            Attribute* uv = out.writable_attribute(obj, Group_Vertices, "uv", VECTOR4_ATTRIB);
-             
-            assert(uv);
-            
-            float ds = (360.0f / float(my_u_extent)) / float(columns); // U change per column
-            float ss = 0.5f - (360.0f / float(my_u_extent)) / 2.0f;     // Starting U
-            float dt = (180.0f / float(my_v_extent)) / float(rows);     // V change per row
-            float st = 0.5 - (180.0 / my_v_extent) / 2.0;              // Starting V
-            float s, t;                                             // Current UV
-            t = st;
-            // Bottom center:
-            if (close_bottom) {
-                s = ss;
-                for (int i = 0; i < columns; i++) {
-                    unsigned v = (*PRIMS++)->vertex_offset();
-                    
-                    uv->vector4(v++).set(   s, 0.0f, 0.0f, 1.0f);
-                 
-                    
-                    uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
-                    
-                    uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-                   
-                    s += ds;
-                }
-                t += dt;
-            }
-            
-            // Create the poly mesh in center:
-            for (int j = 0; j < rows - 2; j++) {
-                s = ss;
-                for (int i = 0; i < columns; i++) {
-                    unsigned v = (*PRIMS++)->vertex_offset();
-                    uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
-                    uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
-                    uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-                    v = (*PRIMS++)->vertex_offset();
-                    uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-                    uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
-                    uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
-                    s += ds;
-                }
-                t += dt;
-            }
-            
-            // Top endcap:
-            if (close_top) {
-                s = ss;
-                for (int i = 0; i < columns; i++) {
-                    unsigned v = (*PRIMS++)->vertex_offset();
-                    uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
-                    uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
-                    uv->vector4(v++).set(   s, 1.0f, 0.0f, 1.0f);
-                    s += ds;
-                }
-            }*/
         }
     }
     
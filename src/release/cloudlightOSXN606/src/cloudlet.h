@@ -12,6 +12,16 @@
 #ifndef cloudLights_cloudlet_h
 #define cloudLights_cloudlet_h
 
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 class cloudlet {
     
 public:
@@ -27,6 +37,283 @@ public:
     int p;
 };
 
+// Growable array of plain values whose storage is aligned for vector
+// loads and stores. Contents are not initialised on resize.
+template <class T>
+class CloudletArray {
+    
+public:
+    enum { ALIGNMENT = 32 };
+    
+    CloudletArray() : data_(0), size_(0), capacity_(0) {}
+    
+    CloudletArray(const CloudletArray& src) : data_(0), size_(0), capacity_(0)
+    {
+        resize(src.size_);
+        if (size_)
+            memcpy(data_, src.data_, size_ * sizeof(T));
+    }
+    
+    ~CloudletArray() { release(data_); }
+    
+    CloudletArray& operator=(const CloudletArray& src)
+    {
+        if (this != &src) {
+            resize(src.size_);
+            if (size_)
+                memcpy(data_, src.data_, size_ * sizeof(T));
+        }
+        return *this;
+    }
+    
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    
+    void clear() { size_ = 0; }
+    
+    void reserve(size_t n)
+    {
+        if (n <= capacity_)
+            return;
+        T* grown = allocate(n);
+        if (size_)
+            memcpy(grown, data_, size_ * sizeof(T));
+        release(data_);
+        data_ = grown;
+        capacity_ = n;
+    }
+    
+    void resize(size_t n)
+    {
+        if (n > capacity_)
+            reserve(n > capacity_ * 2 ? n : capacity_ * 2);
+        size_ = n;
+    }
+    
+    void push_back(const T& v)
+    {
+        if (size_ == capacity_)
+            reserve(capacity_ ? capacity_ * 2 : 256);
+        data_[size_++] = v;
+    }
+    
+    void swap(CloudletArray& other)
+    {
+        T* d = data_; data_ = other.data_; other.data_ = d;
+        size_t s = size_; size_ = other.size_; other.size_ = s;
+        size_t c = capacity_; capacity_ = other.capacity_; other.capacity_ = c;
+    }
+    
+private:
+    // Throws std::bad_alloc like new when the memory is not there.
+    static T* allocate(size_t n)
+    {
+        if (n > (size_t)-1 / sizeof(T))
+            throw std::bad_alloc();
+#ifdef _WIN32
+        void* mem = _aligned_malloc(n * sizeof(T), ALIGNMENT);
+        if (!mem)
+            throw std::bad_alloc();
+#else
+        void* mem = 0;
+        if (posix_memalign(&mem, ALIGNMENT, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+#endif
+        return (T*)mem;
+    }
+    
+    static void release(T* mem)
+    {
+#ifdef _WIN32
+        _aligned_free(mem);
+#else
+        free(mem);
+#endif
+    }
+    
+    T* data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+// Structure-of-arrays cloud: each cloudlet field lives in its own aligned
+// array so that a pass only streams the fields it reads.
+class CloudletBuffer {
+    
+public:
+    // position
+    CloudletArray<float> x;
+    CloudletArray<float> y;
+    CloudletArray<float> z;
+    
+    // color
+    CloudletArray<float> r;
+    CloudletArray<float> g;
+    CloudletArray<float> b;
+    
+    // grid index of the source pixel
+    CloudletArray<int> p;
+    
+    size_t size() const { return p.size(); }
+    bool empty() const { return p.empty(); }
+    
+    void clear()
+    {
+        x.clear(); y.clear(); z.clear();
+        r.clear(); g.clear(); b.clear();
+        p.clear();
+    }
+    
+    void reserve(size_t n)
+    {
+        x.reserve(n); y.reserve(n); z.reserve(n);
+        r.reserve(n); g.reserve(n); b.reserve(n);
+        p.reserve(n);
+    }
+    
+    void resize(size_t n)
+    {
+        x.resize(n); y.resize(n); z.resize(n);
+        r.resize(n); g.resize(n); b.resize(n);
+        p.resize(n);
+    }
+    
+    void push_back(const cloudlet& CL)
+    {
+        x.push_back(CL.x); y.push_back(CL.y); z.push_back(CL.z);
+        r.push_back(CL.r); g.push_back(CL.g); b.push_back(CL.b);
+        p.push_back(CL.p);
+    }
+    
+    cloudlet get(size_t i) const
+    {
+        cloudlet CL;
+        CL.x = x[i]; CL.y = y[i]; CL.z = z[i];
+        CL.r = r[i]; CL.g = g[i]; CL.b = b[i];
+        CL.p = p[i];
+        return CL;
+    }
+    
+    void set(size_t i, const cloudlet& CL)
+    {
+        x[i] = CL.x; y[i] = CL.y; z[i] = CL.z;
+        r[i] = CL.r; g[i] = CL.g; b[i] = CL.b;
+        p[i] = CL.p;
+    }
+    
+    // Copies all of src into this buffer starting at cloudlet offset.
+    // The buffer must already be large enough.
+    void copy_from(size_t offset, const CloudletBuffer& src)
+    {
+        size_t n = src.size();
+        if (!n)
+            return;
+        memcpy(x.data() + offset, src.x.data(), n * sizeof(float));
+        memcpy(y.data() + offset, src.y.data(), n * sizeof(float));
+        memcpy(z.data() + offset, src.z.data(), n * sizeof(float));
+        memcpy(r.data() + offset, src.r.data(), n * sizeof(float));
+        memcpy(g.data() + offset, src.g.data(), n * sizeof(float));
+        memcpy(b.data() + offset, src.b.data(), n * sizeof(float));
+        memcpy(p.data() + offset, src.p.data(), n * sizeof(int));
+    }
+    
+    void swap(CloudletBuffer& other)
+    {
+        x.swap(other.x); y.swap(other.y); z.swap(other.z);
+        r.swap(other.r); g.swap(other.g); b.swap(other.b);
+        p.swap(other.p);
+    }
+};
+
+// Keeps the capacity most important cloudlets pushed into it, using a
+// min-heap so that memory stays bounded however many are pushed. Equal
+// importances favour the lower pixel index and then the earlier push, so
+// the kept set only depends on the order the cloudlets of each pixel were
+// pushed in, whatever the order of the pixels.
+class CloudletHeap {
+
+public:
+    explicit CloudletHeap(size_t capacity = 0) : capacity_(capacity), pushed_(0) {}
+
+    size_t size() const { return entries_.size(); }
+
+    void clear()
+    {
+        entries_.clear();
+        pushed_ = 0;
+    }
+
+    void push(const cloudlet& CL, float importance)
+    {
+        Entry entry;
+        entry.importance = importance;
+        entry.order = pushed_++;
+        entry.CL = CL;
+        push(entry);
+    }
+
+    // Pushes the kept cloudlets of other, which keep their push order.
+    void merge(const CloudletHeap& other)
+    {
+        for (size_t i = 0; i < other.entries_.size(); i++)
+            push(other.entries_[i]);
+    }
+
+    // Replaces dest with the kept cloudlets in pixel index order, and in
+    // push order within a pixel.
+    void extract(CloudletBuffer& dest) const
+    {
+        std::vector<std::pair<std::pair<int, unsigned>, size_t> > order(entries_.size());
+        for (size_t i = 0; i < entries_.size(); i++)
+            order[i] = std::make_pair(std::make_pair(entries_[i].CL.p, entries_[i].order), i);
+        std::sort(order.begin(), order.end());
+
+        dest.clear();
+        dest.reserve(order.size());
+        for (size_t i = 0; i < order.size(); i++)
+            dest.push_back(entries_[order[i].second].CL);
+    }
+
+private:
+    struct Entry {
+        float importance;
+        unsigned order;
+        cloudlet CL;
+    };
+
+    void push(const Entry& entry)
+    {
+        if (entries_.size() < capacity_) {
+            entries_.push_back(entry);
+            std::push_heap(entries_.begin(), entries_.end(), more_important);
+        }
+        else if (capacity_ && more_important(entry, entries_.front())) {
+            std::pop_heap(entries_.begin(), entries_.end(), more_important);
+            entries_.back() = entry;
+            std::push_heap(entries_.begin(), entries_.end(), more_important);
+        }
+    }
+
+    static bool more_important(const Entry& a, const Entry& b)
+    {
+        if (a.importance != b.importance)
+            return a.importance > b.importance;
+        if (a.CL.p != b.CL.p)
+            return a.CL.p < b.CL.p;
+        return a.order < b.order;
+    }
+
+    size_t capacity_;
+    unsigned pushed_;
+    std::vector<Entry> entries_;
+};
+
 
 
 #endif
@@ -0,0 +1,233 @@
+//
+//  cloudletCache.h
+//  cloudLights
+//
+//  On-disk cache of extracted clouds. A cache file is a fixed header
+//  followed by the CloudletBuffer arrays, so loading it is a file mapping
+//  and one copy per array.
+//
+
+#ifndef cloudLights_cloudletCache_h
+#define cloudLights_cloudletCache_h
+
+#include "cloudlet.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct CloudletCacheHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    unsigned long long key;
+    unsigned long long count;
+    int gridColumns;
+    int gridRows;
+    unsigned long long padding[3];
+};
+
+static const char cloudletCacheMagic[8] = { 'C', 'L', 'O', 'U', 'D', 'L', 'T', 0 };
+static const unsigned int cloudletCacheVersion = 1;
+
+// Read-only mapping of a whole file; data() is NULL if it could not be mapped.
+class CloudletMappedFile {
+
+public:
+    explicit CloudletMappedFile(const char* path) : data_(0), size_(0)
+    {
+#ifdef _WIN32
+        file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        mapping_ = NULL;
+        if (file_ == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0)
+            return;
+        mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping_ == NULL)
+            return;
+        data_ = (const unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        if (data_)
+            size_ = (size_t)size.QuadPart;
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem != MAP_FAILED) {
+                data_ = (const unsigned char*)mem;
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~CloudletMappedFile()
+    {
+#ifdef _WIN32
+        if (data_)
+            UnmapViewOfFile(data_);
+        if (mapping_ != NULL)
+            CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)
+            CloseHandle(file_);
+#else
+        if (data_)
+            munmap((void*)data_, size_);
+#endif
+    }
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    CloudletMappedFile(const CloudletMappedFile&);
+    CloudletMappedFile& operator=(const CloudletMappedFile&);
+
+    const unsigned char* data_;
+    size_t size_;
+#ifdef _WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+
+inline std::string cloudlet_cache_path(const char* dir, unsigned long long key)
+{
+    char name[64];
+    sprintf(name, "cloudLight1_%016llx.cloud", key);
+
+    std::string path(dir);
+    if (!path.empty() && path[path.size() - 1] != '/' && path[path.size() - 1] != '\\')
+        path += '/';
+    return path + name;
+}
+
+// Checks that file is a whole cache file for key and grid size, and fills
+// n with its number of cloudlets.
+inline bool cloudlet_cache_check(const CloudletMappedFile& file, unsigned long long key, int gridColumns,
+                                 int gridRows, size_t& n)
+{
+    if (!file.data() || file.size() < sizeof(CloudletCacheHeader))
+        return false;
+
+    CloudletCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, cloudletCacheMagic, sizeof(header.magic)) != 0 ||
+        header.version != cloudletCacheVersion || header.key != key ||
+        header.gridColumns != gridColumns || header.gridRows != gridRows)
+        return false;
+
+    n = (size_t)header.count;
+    return file.size() == sizeof(header) + n * (6 * sizeof(float) + sizeof(int));
+}
+
+/*! Loads the cloud stored under key in dir. Returns false, leaving dest
+    untouched, if there is no valid file for that key and grid size.
+ */
+inline bool cloudlet_cache_load(const char* dir, unsigned long long key, int gridColumns, int gridRows,
+                                CloudletBuffer& dest)
+{
+    CloudletMappedFile file(cloudlet_cache_path(dir, key).c_str());
+    size_t n;
+    if (!cloudlet_cache_check(file, key, gridColumns, gridRows, n))
+        return false;
+
+    dest.resize(n);
+    if (!n)
+        return true;
+
+    const unsigned char* src = file.data() + sizeof(CloudletCacheHeader);
+    float* floats[6] = { dest.x.data(), dest.y.data(), dest.z.data(),
+                         dest.r.data(), dest.g.data(), dest.b.data() };
+    for (int i = 0; i < 6; i++) {
+        memcpy(floats[i], src, n * sizeof(float));
+        src += n * sizeof(float);
+    }
+    memcpy(dest.p.data(), src, n * sizeof(int));
+    return true;
+}
+
+// Loads only the pixel indices of the cloud stored under key in dir.
+inline bool cloudlet_cache_load_pixels(const char* dir, unsigned long long key, int gridColumns, int gridRows,
+                                       CloudletArray<int>& dest)
+{
+    CloudletMappedFile file(cloudlet_cache_path(dir, key).c_str());
+    size_t n;
+    if (!cloudlet_cache_check(file, key, gridColumns, gridRows, n))
+        return false;
+
+    dest.resize(n);
+    if (n)
+        memcpy(dest.data(), file.data() + sizeof(CloudletCacheHeader) + n * 6 * sizeof(float), n * sizeof(int));
+    return true;
+}
+
+/*! Stores src under key in dir. The file is written under a temporary name
+    and renamed into place, so concurrent renders never see a partial file.
+ */
+inline bool cloudlet_cache_save(const char* dir, unsigned long long key, int gridColumns, int gridRows,
+                                const CloudletBuffer& src)
+{
+    std::string path = cloudlet_cache_path(dir, key);
+
+    char suffix[64];
+#ifdef _WIN32
+    sprintf(suffix, ".%lu.%p.tmp", (unsigned long)_getpid(), (const void*)&src);
+#else
+    sprintf(suffix, ".%lu.%p.tmp", (unsigned long)getpid(), (const void*)&src);
+#endif
+    std::string temp = path + suffix;
+
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f)
+        return false;
+
+    CloudletCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cloudletCacheMagic, sizeof(header.magic));
+    header.version = cloudletCacheVersion;
+    header.key = key;
+    header.count = src.size();
+    header.gridColumns = gridColumns;
+    header.gridRows = gridRows;
+
+    size_t n = src.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (n) {
+        const float* floats[6] = { src.x.data(), src.y.data(), src.z.data(),
+                                   src.r.data(), src.g.data(), src.b.data() };
+        for (int i = 0; ok && i < 6; i++)
+            ok = fwrite(floats[i], sizeof(float), n, f) == n;
+        ok = ok && fwrite(src.p.data(), sizeof(int), n, f) == n;
+    }
+    ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok)
+        remove(temp.c_str());
+    return ok;
+}
+
+#endif
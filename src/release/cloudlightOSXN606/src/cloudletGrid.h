@@ -0,0 +1,172 @@
+//
+//  cloudletGrid.h
+//  cloudLights
+//
+//  Voxel hash accumulator. Clouds are streamed in one after another and
+//  every occupied voxel keeps only running sums, so memory follows the
+//  number of voxels rather than the number of cloudlets added.
+//
+
+#ifndef cloudLights_cloudletGrid_h
+#define cloudLights_cloudletGrid_h
+
+#include "cloudlet.h"
+
+#include <math.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+class CloudletVoxelGrid {
+
+public:
+    /*! Voxels are cubes of edge voxel over the positions multiplied per
+        axis by scale. A grid whose voxel is not positive stays empty.
+     */
+    CloudletVoxelGrid(float voxel, const float scale[3]) : voxel_(voxel), mask_(0)
+    {
+        for (int a = 0; a < 3; a++)
+            scale_[a] = scale[a];
+        slots_.assign(1024, EMPTY);
+        mask_ = slots_.size() - 1;
+    }
+
+    size_t size() const { return voxels_.size(); }
+
+    void add(const CloudletBuffer& src)
+    {
+        for (size_t i = 0; i < src.size(); i++)
+            add(src.get(i));
+    }
+
+    // Adds CL to its voxel. Positions that are not finite, or too far out
+    // for a 64-bit voxel coordinate, are skipped.
+    void add(const cloudlet& CL)
+    {
+        Key key;
+        if (!voxel_key(CL.x * scale_[0], CL.y * scale_[1], CL.z * scale_[2], key))
+            return;
+
+        size_t slot = find(key);
+        if (slots_[slot] == EMPTY) {
+            slots_[slot] = (unsigned)voxels_.size();
+            keys_.push_back(key);
+
+            Voxel voxel;
+            voxel.n = 0.0;
+            for (int c = 0; c < 6; c++)
+                voxel.s[c] = 0.0;
+            voxel.p = CL.p;
+            voxels_.push_back(voxel);
+
+            if (voxels_.size() * 2 > slots_.size())
+                grow();
+            slot = find(key);
+        }
+
+        Voxel& voxel = voxels_[slots_[slot]];
+        voxel.n += 1.0;
+        voxel.s[0] += CL.x;
+        voxel.s[1] += CL.y;
+        voxel.s[2] += CL.z;
+        voxel.s[3] += CL.r;
+        voxel.s[4] += CL.g;
+        voxel.s[5] += CL.b;
+    }
+
+    /*! Replaces dest with one cloudlet per voxel holding the average of
+        everything added to it and the pixel index of its first cloudlet,
+        sorted by that index and then by first arrival.
+     */
+    void extract(CloudletBuffer& dest) const
+    {
+        std::vector<std::pair<int, size_t> > order(voxels_.size());
+        for (size_t i = 0; i < voxels_.size(); i++)
+            order[i] = std::make_pair(voxels_[i].p, i);
+        std::sort(order.begin(), order.end());
+
+        dest.clear();
+        dest.reserve(order.size());
+        for (size_t k = 0; k < order.size(); k++) {
+            const Voxel& voxel = voxels_[order[k].second];
+            cloudlet CL;
+            CL.x = (float)(voxel.s[0] / voxel.n);
+            CL.y = (float)(voxel.s[1] / voxel.n);
+            CL.z = (float)(voxel.s[2] / voxel.n);
+            CL.r = (float)(voxel.s[3] / voxel.n);
+            CL.g = (float)(voxel.s[4] / voxel.n);
+            CL.b = (float)(voxel.s[5] / voxel.n);
+            CL.p = voxel.p;
+            dest.push_back(CL);
+        }
+    }
+
+private:
+    enum { EMPTY = 0xffffffffu };
+
+    struct Voxel {
+        double n;
+        double s[6];
+        int p;
+    };
+
+    // Voxel coordinates, whole on every axis so distant voxels never share
+    // a key.
+    struct Key {
+        long long x, y, z;
+
+        bool operator==(const Key& other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+        bool operator!=(const Key& other) const { return !(*this == other); }
+    };
+
+    // Fills key with the voxel of (x, y, z), or returns false when it has
+    // none.
+    bool voxel_key(float x, float y, float z, Key& key) const
+    {
+        if (!(voxel_ > 0.0f))
+            return false;
+
+        double c[3] = { floor((double)x / voxel_), floor((double)y / voxel_), floor((double)z / voxel_) };
+        for (int a = 0; a < 3; a++) {
+            // Also false for NaN:
+            if (!(fabs(c[a]) < 9.0e18))
+                return false;
+        }
+        key.x = (long long)c[0];
+        key.y = (long long)c[1];
+        key.z = (long long)c[2];
+        return true;
+    }
+
+    // Slot holding key, or the empty slot it would go in.
+    size_t find(const Key& key) const
+    {
+        unsigned long long h = (unsigned long long)key.x * 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (unsigned long long)key.y) * 0xc2b2ae3d27d4eb4fULL;
+        h = (h ^ (unsigned long long)key.z) * 0x165667b19e3779f9ULL;
+        size_t slot = (size_t)(h >> 20) & mask_;
+        while (slots_[slot] != EMPTY && keys_[slots_[slot]] != key)
+            slot = (slot + 1) & mask_;
+        return slot;
+    }
+
+    void grow()
+    {
+        slots_.assign(slots_.size() * 2, EMPTY);
+        mask_ = slots_.size() - 1;
+        for (size_t i = 0; i < keys_.size(); i++)
+            slots_[find(keys_[i])] = (unsigned)i;
+    }
+
+    float voxel_;
+    float scale_[3];
+    std::vector<unsigned> slots_;
+    size_t mask_;
+    std::vector<Key> keys_;
+    std::vector<Voxel> voxels_;
+};
+
+#endif
@@ -0,0 +1,502 @@
+//
+//  cloudletKernels.h
+//  cloudLights
+//
+//  Vertex generation kernels for cloudlet geometry. Every kernel writes
+//  the same xyz triples up to rounding: the compiler may fuse the
+//  multiply-add of the scalar loop but not of the vector ones. The AVX
+//  version is picked at runtime where both the compiler and the CPU
+//  support it; otherwise the SSE2 one, or the scalar loop off x86.
+//
+
+#ifndef cloudLights_cloudletKernels_h
+#define cloudLights_cloudletKernels_h
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLOUDLET_SSE 1
+#include <emmintrin.h>
+#endif
+
+// The AVX kernel needs per function target attributes and a cpu feature
+// builtin, i.e. GCC 4.8 or clang 3.8, or the xgetbv intrinsic of Visual
+// Studio 2010 SP1. Older toolchains, like the ones of Nuke 6, only get the
+// SSE2 kernel.
+#ifdef CLOUDLET_SSE
+#if defined(_MSC_VER) && !defined(__clang__)
+#if _MSC_FULL_VER >= 160040219
+#define CLOUDLET_AVX 1
+#endif
+#elif defined(__clang__)
+#if defined(__has_builtin) && defined(__has_attribute)
+#if __has_builtin(__builtin_cpu_supports) && __has_attribute(target)
+#define CLOUDLET_AVX 1
+#endif
+#endif
+#elif defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)
+#define CLOUDLET_AVX 1
+#endif
+#endif
+#endif
+
+#ifdef CLOUDLET_AVX
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__GNUC__) && !defined(_MSC_VER)
+#define CLOUDLET_TARGET_AVX __attribute__((target("avx")))
+#else
+#define CLOUDLET_TARGET_AVX
+#endif
+#endif
+
+// Cube faces, in the order cloudLight1 emits them.
+enum {
+    CLOUDLET_BACK   = 1 << 0,
+    CLOUDLET_FRONT  = 1 << 1,
+    CLOUDLET_TOP    = 1 << 2,
+    CLOUDLET_BOTTOM = 1 << 3,
+    CLOUDLET_LEFT   = 1 << 4,
+    CLOUDLET_RIGHT  = 1 << 5,
+    CLOUDLET_ALL_FACES = 63
+};
+
+inline int cloudlet_face_count(int faceMask)
+{
+    int faces = 0;
+    for (int face = 0; face < 6; face++)
+        faces += (faceMask >> face) & 1;
+    return faces;
+}
+
+// Two triangles per face as cube corner indices, where bit 0 of a corner
+// is +x, bit 1 is +y and bit 2 is +z, wound counterclockwise seen from
+// outside so their winding gives the face normal.
+static const int cloudletFaceCorners[6][6] = {
+    { 0, 2, 1,   1, 2, 3 },    // back
+    { 4, 5, 6,   6, 5, 7 },    // front
+    { 2, 6, 3,   3, 6, 7 },    // top
+    { 0, 1, 4,   4, 1, 5 },    // bottom
+    { 0, 4, 2,   2, 4, 6 },    // left
+    { 1, 3, 5,   5, 3, 7 },    // right
+};
+
+// Outward normal of each face.
+static const float cloudletFaceNormals[6][3] = {
+    {  0.0f,  0.0f, -1.0f },   // back
+    {  0.0f,  0.0f,  1.0f },   // front
+    {  0.0f,  1.0f,  0.0f },   // top
+    {  0.0f, -1.0f,  0.0f },   // bottom
+    { -1.0f,  0.0f,  0.0f },   // left
+    {  1.0f,  0.0f,  0.0f },   // right
+};
+
+// Two triangles of a billboard quad as corner indices, where bit 0 of a
+// corner is along the right vector and bit 1 along the up vector, wound
+// to face the viewer.
+static const int cloudletQuadCorners[6] = { 0, 1, 2,   2, 1, 3 };
+
+// A cloudlet shape other than the cube: its corners, in halves of the
+// cloudlet size, and its triangles as corner indices wound counterclockwise
+// seen from outside.
+struct CloudletSolid {
+    int corners;
+    int triangles;
+    const float (*cornerTable)[3];
+    const int (*triangleTable)[3];
+};
+
+// Every other corner of the cube.
+static const float cloudletTetraCorners[4][3] = {
+    {  1.0f,  1.0f,  1.0f },
+    {  1.0f, -1.0f, -1.0f },
+    { -1.0f,  1.0f, -1.0f },
+    { -1.0f, -1.0f,  1.0f },
+};
+static const int cloudletTetraTriangles[4][3] = {
+    { 1, 3, 2 }, { 0, 2, 3 }, { 0, 3, 1 }, { 0, 1, 2 },
+};
+
+// The centers of the cube faces: +x, -x, +y, -y, +z, -z.
+static const float cloudletOctaCorners[6][3] = {
+    {  1.0f,  0.0f,  0.0f },
+    { -1.0f,  0.0f,  0.0f },
+    {  0.0f,  1.0f,  0.0f },
+    {  0.0f, -1.0f,  0.0f },
+    {  0.0f,  0.0f,  1.0f },
+    {  0.0f,  0.0f, -1.0f },
+};
+static const int cloudletOctaTriangles[8][3] = {
+    { 0, 2, 4 }, { 1, 4, 2 }, { 0, 4, 3 }, { 0, 5, 2 },
+    { 1, 3, 4 }, { 1, 2, 5 }, { 0, 3, 5 }, { 1, 5, 3 },
+};
+
+static const CloudletSolid cloudletTetrahedron = { 4, 4, cloudletTetraCorners, cloudletTetraTriangles };
+static const CloudletSolid cloudletOctahedron = { 6, 8, cloudletOctaCorners, cloudletOctaTriangles };
+
+// Per-vertex offsets from the cloudlet position for one face selection,
+// stored as consecutive xyz triples.
+struct CloudletVertexTable {
+
+    enum { MAX_VERTICES = 36 };
+
+    int vertices;
+    float offsets[MAX_VERTICES * 3];
+
+    void build(int faceMask, float size)
+    {
+        float center = size / 2.0f;
+        float lo = 0.0f - center;
+        float hi = size - center;
+
+        vertices = 0;
+        for (int face = 0; face < 6; face++) {
+            if (!(faceMask & (1 << face)))
+                continue;
+            for (int i = 0; i < 6; i++) {
+                int corner = cloudletFaceCorners[face][i];
+                float* o = offsets + vertices * 3;
+                o[0] = (corner & 1) ? hi : lo;
+                o[1] = (corner & 2) ? hi : lo;
+                o[2] = (corner & 4) ? hi : lo;
+                vertices++;
+            }
+        }
+    }
+    
+    // The 8 cube corners, indexed as in cloudletFaceCorners.
+    void build_corners(float size)
+    {
+        float center = size / 2.0f;
+        float lo = 0.0f - center;
+        float hi = size - center;
+
+        for (int corner = 0; corner < 8; corner++) {
+            float* o = offsets + corner * 3;
+            o[0] = (corner & 1) ? hi : lo;
+            o[1] = (corner & 2) ? hi : lo;
+            o[2] = (corner & 4) ? hi : lo;
+        }
+        vertices = 8;
+    }
+    
+    // A square of edge size spanned by the unit vectors right and up, as
+    // its 2 triangles.
+    void build_quad(const float right[3], const float up[3], float size)
+    {
+        for (int i = 0; i < 6; i++)
+            quad_corner(offsets + i * 3, cloudletQuadCorners[i], right, up, size);
+        vertices = 6;
+    }
+    
+    // The 4 quad corners, indexed as in cloudletQuadCorners.
+    void build_quad_corners(const float right[3], const float up[3], float size)
+    {
+        for (int corner = 0; corner < 4; corner++)
+            quad_corner(offsets + corner * 3, corner, right, up, size);
+        vertices = 4;
+    }
+    
+    // A single vertex at the cloudlet position, for instanced output.
+    void build_center()
+    {
+        offsets[0] = offsets[1] = offsets[2] = 0.0f;
+        vertices = 1;
+    }
+    
+    // The outward normal of every vertex of build(faceMask), in the same
+    // order, so it also fills the vertices of the matching triangles.
+    void build_normals(int faceMask)
+    {
+        vertices = 0;
+        for (int face = 0; face < 6; face++) {
+            if (!(faceMask & (1 << face)))
+                continue;
+            for (int i = 0; i < 6; i++) {
+                float* o = offsets + vertices * 3;
+                o[0] = cloudletFaceNormals[face][0];
+                o[1] = cloudletFaceNormals[face][1];
+                o[2] = cloudletFaceNormals[face][2];
+                vertices++;
+            }
+        }
+    }
+    
+    // The 3 corners of every triangle of solid, for a cloudlet of edge size.
+    void build_solid(const CloudletSolid& solid, float size)
+    {
+        float h = size / 2.0f;
+        
+        vertices = 0;
+        for (int t = 0; t < solid.triangles; t++) {
+            for (int i = 0; i < 3; i++) {
+                const float* c = solid.cornerTable[solid.triangleTable[t][i]];
+                float* o = offsets + vertices * 3;
+                o[0] = c[0] * h;
+                o[1] = c[1] * h;
+                o[2] = c[2] * h;
+                vertices++;
+            }
+        }
+    }
+    
+    // The corners of solid, indexed as in its triangle table.
+    void build_solid_corners(const CloudletSolid& solid, float size)
+    {
+        float h = size / 2.0f;
+        
+        for (int corner = 0; corner < solid.corners; corner++) {
+            float* o = offsets + corner * 3;
+            o[0] = solid.cornerTable[corner][0] * h;
+            o[1] = solid.cornerTable[corner][1] * h;
+            o[2] = solid.cornerTable[corner][2] * h;
+        }
+        vertices = solid.corners;
+    }
+    
+    // The outward normal of every vertex of build_solid(solid).
+    void build_solid_normals(const CloudletSolid& solid)
+    {
+        vertices = 0;
+        for (int t = 0; t < solid.triangles; t++) {
+            const float* a = solid.cornerTable[solid.triangleTable[t][0]];
+            const float* b = solid.cornerTable[solid.triangleTable[t][1]];
+            const float* c = solid.cornerTable[solid.triangleTable[t][2]];
+            float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            float n[3] = { u[1] * v[2] - u[2] * v[1],
+                           u[2] * v[0] - u[0] * v[2],
+                           u[0] * v[1] - u[1] * v[0] };
+            float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            
+            for (int i = 0; i < 3; i++) {
+                float* o = offsets + vertices * 3;
+                o[0] = n[0] / len;
+                o[1] = n[1] / len;
+                o[2] = n[2] / len;
+                vertices++;
+            }
+        }
+    }
+    
+    // count copies of the same vector.
+    void build_constant(const float v[3], int count)
+    {
+        for (int i = 0; i < count; i++) {
+            offsets[i * 3 + 0] = v[0];
+            offsets[i * 3 + 1] = v[1];
+            offsets[i * 3 + 2] = v[2];
+        }
+        vertices = count;
+    }
+
+private:
+    static void quad_corner(float* o, int corner, const float right[3], const float up[3], float size)
+    {
+        float h = size / 2.0f;
+        float r = (corner & 1) ? h : -h;
+        float u = (corner & 2) ? h : -h;
+        for (int a = 0; a < 3; a++)
+            o[a] = right[a] * r + up[a] * u;
+    }
+};
+
+// Writes table.vertices points for each cloudlet in [begin, end). The
+// position of cloudlet i is (X[i], Y[i], Z[i]) multiplied per axis by
+// scale, its offsets are multiplied by S[i] unless S is NULL, and out
+// points at the first vertex of cloudlet begin.
+typedef void (*CloudletVertexKernel)(const float* X, const float* Y, const float* Z, const float* S,
+                                     size_t begin, size_t end, const float scale[3],
+                                     const CloudletVertexTable& table, float* out);
+
+inline void cloudlet_vertices_scalar(const float* X, const float* Y, const float* Z, const float* S,
+                                     size_t begin, size_t end, const float scale[3],
+                                     const CloudletVertexTable& table, float* out)
+{
+    const int floats = table.vertices * 3;
+
+    for (size_t i = begin; i < end; i++) {
+        float x = X[i] * scale[0];
+        float y = Y[i] * scale[1];
+        float z = Z[i] * scale[2];
+        float s = S ? S[i] : 1.0f;
+
+        const float* o = table.offsets;
+        for (int k = 0; k < floats; k += 3) {
+            out[k + 0] = x + o[k + 0] * s;
+            out[k + 1] = y + o[k + 1] * s;
+            out[k + 2] = z + o[k + 2] * s;
+        }
+        out += floats;
+    }
+}
+
+#ifdef CLOUDLET_SSE
+
+// The xyz pattern repeats every 12 floats, i.e. every three SSE registers.
+inline void cloudlet_vertices_sse(const float* X, const float* Y, const float* Z, const float* S,
+                                  size_t begin, size_t end, const float scale[3],
+                                  const CloudletVertexTable& table, float* out)
+{
+    const int floats = table.vertices * 3;
+    const float* o = table.offsets;
+
+    for (size_t i = begin; i < end; i++) {
+        float x = X[i] * scale[0];
+        float y = Y[i] * scale[1];
+        float z = Z[i] * scale[2];
+
+        float s = S ? S[i] : 1.0f;
+
+        __m128 b0 = _mm_setr_ps(x, y, z, x);
+        __m128 b1 = _mm_setr_ps(y, z, x, y);
+        __m128 b2 = _mm_setr_ps(z, x, y, z);
+        __m128 vs = _mm_set1_ps(s);
+
+        int k = 0;
+        for (; k + 12 <= floats; k += 12) {
+            _mm_storeu_ps(out + k + 0, _mm_add_ps(b0, _mm_mul_ps(_mm_loadu_ps(o + k + 0), vs)));
+            _mm_storeu_ps(out + k + 4, _mm_add_ps(b1, _mm_mul_ps(_mm_loadu_ps(o + k + 4), vs)));
+            _mm_storeu_ps(out + k + 8, _mm_add_ps(b2, _mm_mul_ps(_mm_loadu_ps(o + k + 8), vs)));
+        }
+        for (; k < floats; k += 3) {
+            out[k + 0] = x + o[k + 0] * s;
+            out[k + 1] = y + o[k + 1] * s;
+            out[k + 2] = z + o[k + 2] * s;
+        }
+        out += floats;
+    }
+}
+
+#endif
+
+#ifdef CLOUDLET_AVX
+
+// Same as the SSE kernel with a 24 float period over 8-wide registers.
+CLOUDLET_TARGET_AVX
+inline void cloudlet_vertices_avx(const float* X, const float* Y, const float* Z, const float* S,
+                                  size_t begin, size_t end, const float scale[3],
+                                  const CloudletVertexTable& table, float* out)
+{
+    const int floats = table.vertices * 3;
+    const float* o = table.offsets;
+
+    for (size_t i = begin; i < end; i++) {
+        float x = X[i] * scale[0];
+        float y = Y[i] * scale[1];
+        float z = Z[i] * scale[2];
+
+        float s = S ? S[i] : 1.0f;
+
+        __m256 b0 = _mm256_setr_ps(x, y, z, x, y, z, x, y);
+        __m256 b1 = _mm256_setr_ps(z, x, y, z, x, y, z, x);
+        __m256 b2 = _mm256_setr_ps(y, z, x, y, z, x, y, z);
+        __m256 vs = _mm256_set1_ps(s);
+
+        int k = 0;
+        for (; k + 24 <= floats; k += 24) {
+            _mm256_storeu_ps(out + k + 0,  _mm256_add_ps(b0, _mm256_mul_ps(_mm256_loadu_ps(o + k + 0), vs)));
+            _mm256_storeu_ps(out + k + 8,  _mm256_add_ps(b1, _mm256_mul_ps(_mm256_loadu_ps(o + k + 8), vs)));
+            _mm256_storeu_ps(out + k + 16, _mm256_add_ps(b2, _mm256_mul_ps(_mm256_loadu_ps(o + k + 16), vs)));
+        }
+        if (k + 12 <= floats) {
+            __m128 s0 = _mm256_castps256_ps128(b0);
+            __m128 s1 = _mm256_castps256_ps128(b2);
+            __m128 s2 = _mm256_castps256_ps128(b1);
+            __m128 s4 = _mm256_castps256_ps128(vs);
+            _mm_storeu_ps(out + k + 0, _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(o + k + 0), s4)));
+            _mm_storeu_ps(out + k + 4, _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(o + k + 4), s4)));
+            _mm_storeu_ps(out + k + 8, _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(o + k + 8), s4)));
+            k += 12;
+        }
+        for (; k < floats; k += 3) {
+            out[k + 0] = x + o[k + 0] * s;
+            out[k + 1] = y + o[k + 1] * s;
+            out[k + 2] = z + o[k + 2] * s;
+        }
+        out += floats;
+    }
+    _mm256_zeroupper();
+}
+
+#endif
+
+// Copies the xyz triples of a table to out for each of n cloudlets, taking
+// tables[faces[i]] for cloudlet i, or tables[0] for all when faces is NULL.
+// Used for attributes that do not depend on the cloudlet position.
+inline void cloudlet_repeat_tables(const CloudletVertexTable* tables, const unsigned char* faces,
+                                   size_t n, float* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        const CloudletVertexTable& table = tables[faces ? faces[i] : 0];
+        size_t floats = table.vertices * 3;
+        memcpy(out, table.offsets, floats * sizeof(float));
+        out += floats;
+    }
+}
+
+// Writes (R[i], G[i], B[i], 1) to every point of cloudlet i in [0, n) as
+// consecutive float4s. Cloudlet i owns points offsets[i] to offsets[i + 1],
+// or points each when offsets is NULL.
+inline void cloudlet_fill_colors(const float* R, const float* G, const float* B, size_t n,
+                                 unsigned points, const unsigned* offsets, float* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        unsigned first = offsets ? offsets[i] : (unsigned)(i * points);
+        unsigned count = offsets ? offsets[i + 1] - first : points;
+        float* o = out + (size_t)first * 4;
+        
+#ifdef CLOUDLET_SSE
+        __m128 c = _mm_setr_ps(R[i], G[i], B[i], 1.0f);
+        for (unsigned k = 0; k < count; k++)
+            _mm_storeu_ps(o + k * 4, c);
+#else
+        for (unsigned k = 0; k < count; k++) {
+            o[k * 4 + 0] = R[i];
+            o[k * 4 + 1] = G[i];
+            o[k * 4 + 2] = B[i];
+            o[k * 4 + 3] = 1.0f;
+        }
+#endif
+    }
+}
+
+inline bool cloudlet_cpu_has_avx()
+{
+#if defined(CLOUDLET_AVX) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx     = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+    // The OS must save the ymm registers on context switches.
+    return (_xgetbv(0) & 6) == 6;
+#elif defined(CLOUDLET_AVX)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") != 0;
+#else
+    return false;
+#endif
+}
+
+// Returns the fastest vertex kernel this CPU supports.
+inline CloudletVertexKernel cloudlet_vertex_kernel()
+{
+#if defined(CLOUDLET_AVX)
+    static const CloudletVertexKernel kernel =
+        cloudlet_cpu_has_avx() ? cloudlet_vertices_avx : cloudlet_vertices_sse;
+    return kernel;
+#elif defined(CLOUDLET_SSE)
+    return cloudlet_vertices_sse;
+#else
+    return cloudlet_vertices_scalar;
+#endif
+}
+
+#endif
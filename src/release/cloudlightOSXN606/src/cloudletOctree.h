@@ -0,0 +1,201 @@
+//
+//  cloudletOctree.h
+//  cloudLights
+//
+//  Octree over a cloud stored as flat arrays. Cloudlets are sorted by the
+//  Morton code of their position, so every node is a contiguous range of
+//  that order and a traversal streams the positions front to back.
+//
+
+#ifndef cloudLights_cloudletOctree_h
+#define cloudLights_cloudletOctree_h
+
+#include "cloudlet.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+struct CloudletOctreeNode {
+    unsigned begin, end;    // range of CloudletOctree::order
+    int firstChild;         // index of the first child, -1 for leaves
+    int children;           // number of children, which are consecutive
+    float lo[3], hi[3];     // bounds of the positions inside
+};
+
+// Spreads the low 21 bits of v so there are two zero bits between each.
+inline unsigned long long cloudlet_morton_spread(unsigned long long v)
+{
+    v &= 0x1fffffULL;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+inline unsigned long long cloudlet_morton(unsigned x, unsigned y, unsigned z)
+{
+    return cloudlet_morton_spread(x) | (cloudlet_morton_spread(y) << 1) | (cloudlet_morton_spread(z) << 2);
+}
+
+class CloudletOctree {
+
+public:
+    enum { LEAF_SIZE = 8, MAX_DEPTH = 21 };
+
+    // nodes[0] is the root.
+    std::vector<CloudletOctreeNode> nodes;
+
+    // Cloudlet index and position, multiplied by the build scale, of every
+    // entry in Morton order.
+    CloudletArray<unsigned> order;
+    CloudletArray<float> x, y, z;
+
+    bool empty() const { return nodes.empty(); }
+
+    void clear()
+    {
+        nodes.clear();
+        order.clear();
+        x.clear();
+        y.clear();
+        z.clear();
+    }
+
+    void swap(CloudletOctree& other)
+    {
+        nodes.swap(other.nodes);
+        order.swap(other.order);
+        x.swap(other.x);
+        y.swap(other.y);
+        z.swap(other.z);
+    }
+
+    /*! Indexes the positions of cloud multiplied per axis by scale. */
+    void build(const CloudletBuffer& cloud, const float scale[3])
+    {
+        clear();
+
+        size_t n = cloud.size();
+        if (!n)
+            return;
+
+        float lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = 1e30f;
+            hi[a] = -1e30f;
+        }
+        for (size_t i = 0; i < n; i++) {
+            float p[3] = { cloud.x[i] * scale[0], cloud.y[i] * scale[1], cloud.z[i] * scale[2] };
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], p[a]);
+                hi[a] = std::max(hi[a], p[a]);
+            }
+        }
+
+        // Quantize into a cube around the bounds:
+        float edge = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+        float cells = (float)(1 << MAX_DEPTH);
+        float quantize = edge > 0.0f ? (cells - 1.0f) / edge : 0.0f;
+
+        std::vector<std::pair<unsigned long long, unsigned> > keys(n);
+        for (size_t i = 0; i < n; i++) {
+            unsigned q[3];
+            q[0] = (unsigned)((cloud.x[i] * scale[0] - lo[0]) * quantize);
+            q[1] = (unsigned)((cloud.y[i] * scale[1] - lo[1]) * quantize);
+            q[2] = (unsigned)((cloud.z[i] * scale[2] - lo[2]) * quantize);
+            keys[i] = std::make_pair(cloudlet_morton(q[0], q[1], q[2]), (unsigned)i);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<unsigned long long> codes(n);
+        order.resize(n);
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            unsigned i = keys[k].second;
+            codes[k] = keys[k].first;
+            order[k] = i;
+            x[k] = cloud.x[i] * scale[0];
+            y[k] = cloud.y[i] * scale[1];
+            z[k] = cloud.z[i] * scale[2];
+        }
+
+        CloudletOctreeNode root;
+        root.begin = 0;
+        root.end = (unsigned)n;
+        nodes.push_back(root);
+        split(0, 0, codes);
+    }
+
+private:
+    // Splits nodes[index], whose codes share their top 3 * depth bits, by
+    // the next 3 bits and fills in the bounds.
+    void split(int index, int depth, const std::vector<unsigned long long>& codes)
+    {
+        unsigned begin = nodes[index].begin;
+        unsigned end = nodes[index].end;
+
+        if (end - begin <= LEAF_SIZE || depth == MAX_DEPTH) {
+            CloudletOctreeNode& node = nodes[index];
+            node.firstChild = -1;
+            node.children = 0;
+            for (int a = 0; a < 3; a++) {
+                node.lo[a] = 1e30f;
+                node.hi[a] = -1e30f;
+            }
+            for (unsigned k = begin; k < end; k++) {
+                float p[3] = { x[k], y[k], z[k] };
+                for (int a = 0; a < 3; a++) {
+                    node.lo[a] = std::min(node.lo[a], p[a]);
+                    node.hi[a] = std::max(node.hi[a], p[a]);
+                }
+            }
+            return;
+        }
+
+        int shift = 3 * (MAX_DEPTH - 1 - depth);
+        unsigned long long prefix = codes[begin] & ~((1ULL << (shift + 3)) - 1);
+
+        unsigned starts[9];
+        for (unsigned long long c = 0; c < 8; c++)
+            starts[c] = (unsigned)(std::lower_bound(codes.begin() + begin, codes.begin() + end,
+                                                    prefix | (c << shift)) - codes.begin());
+        starts[8] = end;
+
+        int first = (int)nodes.size();
+        int children = 0;
+        for (int c = 0; c < 8; c++) {
+            if (starts[c] == starts[c + 1])
+                continue;
+            CloudletOctreeNode child;
+            child.begin = starts[c];
+            child.end = starts[c + 1];
+            nodes.push_back(child);
+            children++;
+        }
+        nodes[index].firstChild = first;
+        nodes[index].children = children;
+
+        for (int c = 0; c < children; c++)
+            split(first + c, depth + 1, codes);
+
+        CloudletOctreeNode& node = nodes[index];
+        for (int a = 0; a < 3; a++) {
+            node.lo[a] = 1e30f;
+            node.hi[a] = -1e30f;
+        }
+        for (int c = 0; c < children; c++) {
+            const CloudletOctreeNode& child = nodes[first + c];
+            for (int a = 0; a < 3; a++) {
+                node.lo[a] = std::min(node.lo[a], child.lo[a]);
+                node.hi[a] = std::max(node.hi[a], child.hi[a]);
+            }
+        }
+    }
+};
+
+#endif
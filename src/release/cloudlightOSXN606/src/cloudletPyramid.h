@@ -0,0 +1,245 @@
+//
+//  cloudletPyramid.h
+//  cloudLights
+//
+//  Quadtree statistics over the sample grid for adaptive sampling. Every
+//  block keeps the count, sums and sums of squares of its solid samples,
+//  so its mean and variance are known without visiting the samples, and
+//  the blocks that vary the most are split first until a budget is met.
+//  The pyramid holds every sample of the grid plus its coarser levels,
+//  about 50 bytes per grid sample, whatever the budget.
+//
+
+#ifndef cloudLights_cloudletPyramid_h
+#define cloudLights_cloudletPyramid_h
+
+#include "cloudlet.h"
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Sums over the solid samples of a block: color in s[0..2], position in
+// s[3..5], and the sums of squares of the color and position components.
+struct CloudletBlock {
+    double n;
+    double s[6];
+    double colorSquares, pointSquares;
+
+    void clear()
+    {
+        n = colorSquares = pointSquares = 0.0;
+        for (int c = 0; c < 6; c++)
+            s[c] = 0.0;
+    }
+
+    void add(const CloudletBlock& other)
+    {
+        n += other.n;
+        for (int c = 0; c < 6; c++)
+            s[c] += other.s[c];
+        colorSquares += other.colorSquares;
+        pointSquares += other.pointSquares;
+    }
+
+    // Summed squared deviation from the mean of the color and position.
+    double color_error() const
+    {
+        return n > 0.0 ? colorSquares - (s[0] * s[0] + s[1] * s[1] + s[2] * s[2]) / n : 0.0;
+    }
+
+    double point_error() const
+    {
+        return n > 0.0 ? pointSquares - (s[3] * s[3] + s[4] * s[4] + s[5] * s[5]) / n : 0.0;
+    }
+};
+
+class CloudletPyramid {
+
+public:
+    CloudletPyramid() : columns_(0), rows_(0) {}
+
+    /*! Sizes the sample grid. Samples start out empty. Memory is O(grid):
+        25 bytes per sample here and about 27 more in build().
+     */
+    void resize(int columns, int rows)
+    {
+        columns_ = columns;
+        rows_ = rows;
+        size_t cells = (size_t)columns * rows;
+        solid.resize(cells);
+        values.resize(cells * 6);
+        for (size_t i = 0; i < cells; i++)
+            solid[i] = 0;
+        levels.clear();
+    }
+
+    // Stores a solid sample at its pixel index. Distinct rows may be
+    // stored from several threads.
+    void push_back(const cloudlet& CL)
+    {
+        float* v = &values[(size_t)CL.p * 6];
+        v[0] = CL.r; v[1] = CL.g; v[2] = CL.b;
+        v[3] = CL.x; v[4] = CL.y; v[5] = CL.z;
+        solid[CL.p] = 1;
+    }
+
+    /*! Sums the samples into the coarser levels, up to a single block. */
+    void build()
+    {
+        levels.clear();
+
+        int w = columns_, h = rows_;
+        while (w > 1 || h > 1) {
+            int pw = w, ph = h;
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+
+            levels.push_back(Level());
+            Level& level = levels.back();
+            level.width = w;
+            level.height = h;
+            level.blocks.resize((size_t)w * h);
+
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    CloudletBlock& sum = level.blocks[(size_t)y * w + x];
+                    sum.clear();
+                    for (int c = 0; c < 4; c++) {
+                        int cx = x * 2 + (c & 1), cy = y * 2 + (c >> 1);
+                        if (cx < pw && cy < ph)
+                            sum.add(block((int)levels.size() - 1, cx, cy));
+                    }
+                }
+            }
+        }
+    }
+
+    /*! Picks at most budget blocks that together cover every solid sample,
+        splitting the block with the largest weighted squared error first.
+        Color and position errors are weighted by the inverse of their
+        variance over the whole grid so neither dominates. Appends one
+        cloudlet per block, with the block mean and the pixel index of its
+        first grid sample, to dest and its edge in grid cells to sizes,
+        both sorted by pixel index.
+     */
+    void select(size_t budget, CloudletBuffer& dest, CloudletArray<float>& sizes) const
+    {
+        dest.clear();
+        sizes.clear();
+
+        int top = (int)levels.size();
+        CloudletBlock root = block(top, 0, 0);
+        if (root.n <= 0.0 || budget == 0)
+            return;
+
+        double colorWeight = 1.0 / std::max(root.color_error() / root.n, 1e-12);
+        double pointWeight = 1.0 / std::max(root.point_error() / root.n, 1e-12);
+
+        // Blocks as (error, (level, index)), largest error on top:
+        typedef std::pair<double, std::pair<int, size_t> > Entry;
+        std::priority_queue<Entry> open;
+        std::vector<std::pair<int, size_t> > leaves;
+
+        open.push(Entry(0.0, std::make_pair(top, (size_t)0)));
+        size_t count = 1;
+
+        while (!open.empty()) {
+            Entry entry = open.top();
+            int level = entry.second.first;
+            size_t index = entry.second.second;
+
+            // A split replaces one block with up to four:
+            if (level == 0 || count + 3 > budget) {
+                leaves.push_back(entry.second);
+                open.pop();
+                continue;
+            }
+            open.pop();
+            count--;
+
+            int x = (int)(index % width(level)), y = (int)(index / width(level));
+            for (int c = 0; c < 4; c++) {
+                int cx = x * 2 + (c & 1), cy = y * 2 + (c >> 1);
+                if (cx >= width(level - 1) || cy >= height(level - 1))
+                    continue;
+
+                CloudletBlock child = block(level - 1, cx, cy);
+                if (child.n <= 0.0)
+                    continue;
+
+                double error = colorWeight * child.color_error() + pointWeight * child.point_error();
+                open.push(Entry(error, std::make_pair(level - 1, (size_t)cy * width(level - 1) + cx)));
+                count++;
+            }
+        }
+
+        // Leaves in pixel index order of their first grid sample:
+        std::vector<std::pair<int, size_t> > sorted(leaves.size());
+        for (size_t i = 0; i < leaves.size(); i++) {
+            int level = leaves[i].first;
+            size_t index = leaves[i].second;
+            int x = (int)(index % width(level)) << level;
+            int y = (int)(index / width(level)) << level;
+            sorted[i] = std::make_pair(y * columns_ + x, i);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        dest.reserve(sorted.size());
+        sizes.resize(sorted.size());
+        for (size_t k = 0; k < sorted.size(); k++) {
+            int level = leaves[sorted[k].second].first;
+            size_t index = leaves[sorted[k].second].second;
+            CloudletBlock b = block(level, (int)(index % width(level)), (int)(index / width(level)));
+
+            cloudlet CL;
+            CL.r = (float)(b.s[0] / b.n);
+            CL.g = (float)(b.s[1] / b.n);
+            CL.b = (float)(b.s[2] / b.n);
+            CL.x = (float)(b.s[3] / b.n);
+            CL.y = (float)(b.s[4] / b.n);
+            CL.z = (float)(b.s[5] / b.n);
+            CL.p = sorted[k].first;
+            dest.push_back(CL);
+            sizes[k] = (float)(1 << level);
+        }
+    }
+
+private:
+    struct Level {
+        int width, height;
+        std::vector<CloudletBlock> blocks;
+    };
+
+    int width(int level) const { return level ? levels[level - 1].width : columns_; }
+    int height(int level) const { return level ? levels[level - 1].height : rows_; }
+
+    // Block (x, y) of level, where level 0 is the sample grid.
+    CloudletBlock block(int level, int x, int y) const
+    {
+        if (level)
+            return levels[level - 1].blocks[(size_t)y * levels[level - 1].width + x];
+
+        CloudletBlock b;
+        b.clear();
+        size_t i = (size_t)y * columns_ + x;
+        if (!solid[i])
+            return b;
+
+        const float* v = &values[i * 6];
+        b.n = 1.0;
+        for (int c = 0; c < 6; c++)
+            b.s[c] = v[c];
+        b.colorSquares = (double)v[0] * v[0] + (double)v[1] * v[1] + (double)v[2] * v[2];
+        b.pointSquares = (double)v[3] * v[3] + (double)v[4] * v[4] + (double)v[5] * v[5];
+        return b;
+    }
+
+    int columns_, rows_;
+    std::vector<unsigned char> solid;
+    std::vector<float> values;
+    std::vector<Level> levels;
+};
+
+#endif